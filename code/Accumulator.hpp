@@ -0,0 +1,178 @@
+//per-pixel radiance sums and sample counts, so samples rendered at different times or places can be added up
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <filesystem>
+
+#include "Image.hpp"
+
+using namespace std;
+
+class Accumulator
+{
+	//beginning of a checkpoint file, followed by sums and counts
+	struct CheckpointHeader
+	{
+		char magic[4];
+		int version;
+		int width;
+		int height;
+	};
+
+	int width;
+	int height;
+
+	vector<float> sums;		//3 floats per pixel, row by row
+	vector<int> counts;		//number of samples per pixel
+
+public:
+	Accumulator(int w, int h) : width(w), height(h), sums(w * h * 3, 0.0f), counts(w * h, 0)
+	{}
+
+	int getWidth() const
+	{
+		return width;
+	}
+
+	int getHeight() const
+	{
+		return height;
+	}
+
+	int getNumPixels() const
+	{
+		return width * height;
+	}
+
+	//"color" is the sum of "samples" samples
+	void add(int x, int y, const Vector3f& color, int samples)
+	{
+		int index = y * width + x;
+		sums[index * 3] += color[0];
+		sums[index * 3 + 1] += color[1];
+		sums[index * 3 + 2] += color[2];
+		counts[index] += samples;
+	}
+
+	//add up two buffers of the same size
+	void add(const Accumulator& other)
+	{
+		for (size_t k = 0; k < sums.size(); k++)
+			sums[k] += other.sums[k];
+		for (size_t k = 0; k < counts.size(); k++)
+			counts[k] += other.counts[k];
+	}
+
+	void clear()
+	{
+		fill(sums.begin(), sums.end(), 0.0f);
+		fill(counts.begin(), counts.end(), 0);
+	}
+
+	//raw buffers, used for communication
+	float* getSums()
+	{
+		return sums.data();
+	}
+	const float* getSums() const
+	{
+		return sums.data();
+	}
+
+	int* getCounts()
+	{
+		return counts.data();
+	}
+	const int* getCounts() const
+	{
+		return counts.data();
+	}
+
+	//smallest sample count of all pixels
+	int getMinimumCount() const
+	{
+		int minimum = counts.empty() ? 0 : counts[0];
+		for (int count : counts)
+			minimum = min(minimum, count);
+		return minimum;
+	}
+
+	//average color of every pixel, pixels without samples are black
+	void toImage(Image& img) const
+	{
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				int index = y * width + x;
+				if (counts[index] == 0)
+				{
+					img.SetPixel(x, y, Vector3f(0, 0, 0));
+					continue;
+				}
+				Vector3f sum(sums[index * 3], sums[index * 3 + 1], sums[index * 3 + 2]);
+				img.SetPixel(x, y, sum / counts[index]);
+			}
+		}
+	}
+
+	//write sums and counts to a binary file, a half-written file never replaces the old one
+	void save(const char* filename) const
+	{
+		string temporary = string(filename) + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file == NULL)
+			throw runtime_error("cannot open checkpoint file " + temporary);
+
+		CheckpointHeader header;
+		memcpy(header.magic, "ACCU", 4);
+		header.version = 1;
+		header.width = width;
+		header.height = height;
+
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+		ok = ok && fwrite(sums.data(), sizeof(float), sums.size(), file) == sums.size();
+		ok = ok && fwrite(counts.data(), sizeof(int), counts.size(), file) == counts.size();
+		ok = (fclose(file) == 0) && ok;
+		if (!ok)
+			throw runtime_error("cannot write checkpoint file " + temporary);
+
+		//replaces the old checkpoint in one step (also on Windows, where "rename" from <cstdio> fails if it exists),
+		//so a crash leaves either the old or the new one
+		error_code error;
+		filesystem::rename(temporary, filename, error);
+		if (error)
+			throw runtime_error("cannot rename checkpoint file " + temporary + ": " + error.message());
+	}
+
+	//replace the buffer with the content of a checkpoint file (the size is taken from the file)
+	void load(const char* filename)
+	{
+		FILE* file = fopen(filename, "rb");
+		if (file == NULL)
+			throw runtime_error("cannot open checkpoint file " + string(filename));
+
+		CheckpointHeader header;
+		if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "ACCU", 4) || header.version != 1
+			|| header.width <= 0 || header.height <= 0)
+		{
+			fclose(file);
+			throw runtime_error("not a checkpoint file: " + string(filename));
+		}
+
+		width = header.width;
+		height = header.height;
+		sums.assign(width * height * 3, 0.0f);
+		counts.assign(width * height, 0);
+
+		bool ok = fread(sums.data(), sizeof(float), sums.size(), file) == sums.size();
+		ok = ok && fread(counts.data(), sizeof(int), counts.size(), file) == counts.size();
+		fclose(file);
+		if (!ok)
+			throw runtime_error("truncated checkpoint file " + string(filename));
+	}
+};
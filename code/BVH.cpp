@@ -1,191 +1,424 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <memory>
 
 #include "BVH.hpp"
-#include "Mesh.hpp"
+#include "Configuration.hpp"
+#include "ThreadPool.hpp"
 
 using namespace std;
 
-//number of triangles in the leaf node
-constexpr int PACK = 50;
+//cost of visiting one more node, relative to intersecting one primitive (surface area heuristic)
+constexpr float TRAVERSALCOST = 1.0f;
 
-//compute the bounding box for a triangle given it's Trig representation 
-Box BVH::computeBoundingBox(const Trig& triangle, const Mesh& mesh)
+//deepest node chosen by the surface area heuristic, deeper nodes are cut in half at the median,
+//so even with a billion primitives the binary tree is less than BVHMAXDEPTH levels deep
+constexpr int SAHDEPTH = 32;
+
+//smallest node that is split by a task of its own when building in parallel, smaller subtrees are built by one task
+constexpr int BVHTASKSIZE = 4096;
+
+//compute the bounding box for a group of primitives
+Box BVHTree::computeBoundingBox(int* indices, int numPrimitives) const
+{
+	Box box = allBoxes[indices[0]];
+	for (int i = 1; i < numPrimitives; i++)
+		box.expand(allBoxes[indices[i]]);
+	return box;
+}
+
+//bin of a primitive center, the same formula is used for counting and for partitioning
+//"lowest" and "extent" describe the range of all centers (centers are doubled, lower + upper)
+int BVHTree::binIndex(const Box& primitive, int dim, float lowest, float extent)
 {
-	//extract vertices
-	Vector3f a = mesh.v[triangle[0]];
-	Vector3f b = mesh.v[triangle[1]];
-	Vector3f c = mesh.v[triangle[2]];
-
-	Vector3f mins(
-		min(min(a[0], b[0]), min(a[0], c[0])),
-		min(min(a[1], b[1]), min(a[1], c[1])),
-		min(min(a[2], b[2]), min(a[2], c[2])));
-	Vector3f maxs(
-		max(max(a[0], b[0]), max(a[0], c[0])),
-		max(max(a[1], b[1]), max(a[1], c[1])),
-		max(max(a[2], b[2]), max(a[2], c[2])));
-
-	return Box(mins, maxs);
+	float center = primitive.lower[dim] + primitive.upper[dim];
+	int bin = (int)((center - lowest) / extent * BVHBINS);
+	return min(max(bin, 0), BVHBINS - 1);
 }
 
-//compute the bounding box for a group of triangles
-Box BVH::computeBoundingBox(int* indices, int numTriangles, const Mesh& mesh)
+//surface area heuristic: the chance that a ray hits a child is proportional to its surface area,
+//so the expected cost of a split is TRAVERSALCOST + (area(back) * #back + area(front) * #front) / area(node)
+//(# = number of primitive tests, see "groupCount")
+//candidate planes are the borders of BVHBINS equal bins between the primitive centers, on every axis
+//returns false if no split is cheaper than a leaf, with "mustSplit" the cheapest split is taken anyway
+bool BVHTree::findSplit(const Box& box, const Box& centers, int* indices, int numPrimitives, bool mustSplit, int& splitDim, int& splitBin) const
 {
-	Box& box0 = allBoxes[indices[0]];
-	float minx = box0.lower[0];
-	float miny = box0.lower[1];
-	float minz = box0.lower[2];
-	float maxx = box0.upper[0];
-	float maxy = box0.upper[1];
-	float maxz = box0.upper[2];
+	float area = box.getSurfaceArea();
+	if (area <= 0)
+		return false;
+
+	//primitives are tested "leafGroupSize" at a time, so a leaf costs one test per group
+	float bestCost = mustSplit ? INFINITY : groupCount(numPrimitives);
+	bool found = false;
 
-	for (int i = 1; i < numTriangles; i++)
+	for (int dim = 0; dim < 3; dim++)
 	{
-		Box& boxi = allBoxes[indices[i]];
-		minx = min(minx, boxi.lower[0]);
-		miny = min(miny, boxi.lower[1]);
-		minz = min(minz, boxi.lower[2]);
+		float extent = centers.upper[dim] - centers.lower[dim];
+		if (extent <= 0)
+			continue;
 
-		maxx = max(maxx, boxi.upper[0]);
-		maxy = max(maxy, boxi.upper[1]);
-		maxz = max(maxz, boxi.upper[2]);
-	}
+		Box bins[BVHBINS];
+		int counts[BVHBINS] = {};
+		for (int i = 0; i < numPrimitives; i++)
+		{
+			const Box& primitive = allBoxes[indices[i]];
+			int bin = binIndex(primitive, dim, centers.lower[dim], extent);
+			if (counts[bin] == 0)
+				bins[bin] = primitive;
+			else
+				bins[bin].expand(primitive);
+			counts[bin]++;
+		}
 
-	return Box(Vector3f(minx, miny, minz), Vector3f(maxx, maxy, maxz));
+		//area and count behind every plane, sweeping from the back
+		float backAreas[BVHBINS];
+		int backCounts[BVHBINS];
+		Box side;
+		int count = 0;
+		for (int bin = 0; bin < BVHBINS - 1; bin++)
+		{
+			if (counts[bin] > 0)
+			{
+				if (count == 0)
+					side = bins[bin];
+				else
+					side.expand(bins[bin]);
+			}
+			count += counts[bin];
+			backAreas[bin] = side.getSurfaceArea();
+			backCounts[bin] = count;
+		}
+
+		//then sweep from the front, plane "bin" lies between bin and bin + 1
+		count = 0;
+		for (int bin = BVHBINS - 1; bin > 0; bin--)
+		{
+			if (counts[bin] > 0)
+			{
+				if (count == 0)
+					side = bins[bin];
+				else
+					side.expand(bins[bin]);
+			}
+			count += counts[bin];
+
+			if (count == 0 || backCounts[bin - 1] == 0)
+				continue;
+
+			float cost = TRAVERSALCOST + (backAreas[bin - 1] * groupCount(backCounts[bin - 1]) + side.getSurfaceArea() * groupCount(count)) / area;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				splitDim = dim;
+				splitBin = bin - 1;
+				found = true;
+			}
+		}
+	}
+	return found;
 }
 
-//compute bounding boxes for all triangles
-void BVH::computeAllBoundingBoxes(int numTriangles, const Mesh& mesh)
+//choose how to split primitives[0 .. numPrimitives) with bounding box "box", reorders them in place
+//returns the number of primitives in the back child, 0 for a leaf
+int BVHTree::splitNode(const Box& box, int* primitives, int numPrimitives, int depth) const
 {
-	const vector<Trig>& trigs = mesh.t;
+	//range of the (doubled) primitive centers
+	Box centers;
+	for (int i = 0; i < numPrimitives; i++)
+	{
+		const Box& primitive = allBoxes[primitives[i]];
+		for (int dim = 0; dim < 3; dim++)
+		{
+			float center = primitive.lower[dim] + primitive.upper[dim];
+			centers.lower[dim] = (i == 0) ? center : min(centers.lower[dim], center);
+			centers.upper[dim] = (i == 0) ? center : max(centers.upper[dim], center);
+		}
+	}
 
-	for (int i = 0; i < numTriangles; i++)
-		allBoxes[i] = computeBoundingBox(trigs[i], mesh);
+	//below SAHDEPTH nodes are cut in half, so the depth stays below BVHMAXDEPTH
+	//a node with too many primitives for a leaf is split even if splitting does not pay off
+	int splitDim = 0;
+	int splitBin = 0;
+	bool mustSplit = numPrimitives > BVHMAXLEAFSIZE;
+	if (numPrimitives > 1 && depth < SAHDEPTH && findSplit(box, centers, primitives, numPrimitives, mustSplit, splitDim, splitBin))
+	{
+		//move primitives behind the plane to the beginning, in place
+		float lowest = centers.lower[splitDim];
+		float extent = centers.upper[splitDim] - lowest;
+		int* middle = partition(primitives, primitives + numPrimitives, [&](int index) {
+			return binIndex(allBoxes[index], splitDim, lowest, extent) <= splitBin;
+		});
+		return middle - primitives;
+	}
+
+	//too many primitives for a leaf, but no plane separates them (e.g. all centers at the same place) or the node is too deep:
+	//cut in half at the median center along the widest axis, so the halves are still apart from each other
+	if (mustSplit)
+	{
+		splitDim = 0;
+		for (int dim = 1; dim < 3; dim++)
+		{
+			if (centers.upper[dim] - centers.lower[dim] > centers.upper[splitDim] - centers.lower[splitDim])
+				splitDim = dim;
+		}
+		nth_element(primitives, primitives + numPrimitives / 2, primitives + numPrimitives, [&](int a, int b) {
+			const Box& first = allBoxes[a];
+			const Box& second = allBoxes[b];
+			return first.lower[splitDim] + first.upper[splitDim] < second.lower[splitDim] + second.upper[splitDim];
+		});
+		return numPrimitives / 2;
+	}
+	return 0;
 }
 
-//split triangles into 2 groups, given the middle  point of each triangle
-void BVH::splitTriangles(float* mids, int* indices, int numTriangles)
+//append the subtree of indices[first .. first + numPrimitives) to "list", returns the index of its root
+int BVHTree::buildNode(vector<BVHBuildNode>& list, int* indices, int first, int numPrimitives, int depth) const
 {
-	//sort the indices and split is automatically done
-	vector<pair<float, int>> midpoints(numTriangles);
-	for (int i = 0; i < numTriangles; i++)
-		midpoints[i] = { mids[i], indices[i] };
-	
-	sort(midpoints.begin(), midpoints.end());
-
-	for (int i=0; i<numTriangles; i++)
-		indices[i] = midpoints[i].second;
+	int* primitives = indices + first;
+
+	int current = list.size();
+	list.push_back(BVHBuildNode());
+	list[current].box = computeBoundingBox(primitives, numPrimitives);
+	list[current].numPrimitives = 0;
+
+	int backSize = splitNode(list[current].box, primitives, numPrimitives, depth);
+	if (backSize == 0)
+	{
+		list[current].offset = first;
+		list[current].numPrimitives = numPrimitives;
+		return current;
+	}
+
+	//"list" grows while building children, so no reference into it is kept
+	buildNode(list, indices, first, backSize, depth + 1);
+	int second = buildNode(list, indices, first + backSize, numPrimitives - backSize, depth + 1);
+	list[current].offset = second;
+	return current;
 }
 
-void BVH::buildNode(BVHNode* node, int* indices, int numTriangles, const Mesh& mesh)
+//node of the upper part of a tree built in parallel
+//large nodes are split by one task each, and both halves become new tasks,
+//below BVHTASKSIZE primitives the whole subtree is built by one task into "subtree"
+struct BVHBuildTask
 {
-	node->box = computeBoundingBox(indices, numTriangles, mesh);
-	node->size = numTriangles;
-	
-	if (numTriangles <= PACK)
+	Box box;
+	int first;
+	int numPrimitives;
+	int depth;
+	unique_ptr<BVHBuildTask> children[2];
+	vector<BVHBuildNode> subtree;
+};
+
+//different tasks work on disjoint ranges of "indices", so they never touch the same data
+void BVHTree::buildTask(ThreadPool& pool, BVHBuildTask* task, int* indices) const
+{
+	int* primitives = indices + task->first;
+	int backSize = 0;
+	if (task->numPrimitives > BVHTASKSIZE)
+	{
+		task->box = computeBoundingBox(primitives, task->numPrimitives);
+		backSize = splitNode(task->box, primitives, task->numPrimitives, task->depth);
+	}
+	if (backSize == 0)
 	{
-		node->isLeaf = true;
-		node->triangles = indices;
+		task->subtree.reserve(2 * task->numPrimitives / BVHMAXLEAFSIZE + 1);
+		buildNode(task->subtree, indices, task->first, task->numPrimitives, task->depth);
 		return;
 	}
 
-	//find longest dimension to split
-	Vector3f dist = node->box.getSize();
-	int splitDim = 0;
-	if (dist[1] > dist[splitDim])
-		splitDim = 1;
-	if (dist[2] > dist[splitDim])
-		splitDim = 2;
-
-	node->splitDim = splitDim;
-	
-	//middle point in split dimension
-	float* midpoints = new float[numTriangles];
-
-	for (int i=0; i<numTriangles; i++)
+	int sizes[2] = { backSize, task->numPrimitives - backSize };
+	for (int i = 0; i < 2; i++)
 	{
-		Box box = allBoxes[indices[i]];
+		BVHBuildTask* child = new BVHBuildTask();
+		child->first = task->first + (i == 0 ? 0 : backSize);
+		child->numPrimitives = sizes[i];
+		child->depth = task->depth + 1;
+		task->children[i].reset(child);
+		pool.submit([this, &pool, child, indices](int) {
+			buildTask(pool, child, indices);
+		});
+	}
+}
 
-		midpoints[i] = (box.lower[splitDim] + box.upper[splitDim]) / 2.0f;
+//append the finished tree of "task" to "list" in depth-first order, the same order "buildNode" produces
+void BVHTree::appendTask(const BVHBuildTask* task, vector<BVHBuildNode>& list)
+{
+	if (!task->children[0])
+	{
+		int base = list.size();
+		for (const BVHBuildNode& node : task->subtree)
+		{
+			list.push_back(node);
+			if (node.numPrimitives == 0)
+				list.back().offset += base;
+		}
+		return;
 	}
 
-	//sort triangles so that I can split them
-	splitTriangles(midpoints, indices, numTriangles);
+	int current = list.size();
+	list.push_back(BVHBuildNode());
+	list[current].box = task->box;
+	list[current].numPrimitives = 0;
+	appendTask(task->children[0].get(), list);
+	list[current].offset = list.size();
+	appendTask(task->children[1].get(), list);
+}
 
-	delete[] midpoints;
+//turn the binary subtree at "index" (an inner node) into 4-wide nodes appended to "list", returns the index of its root
+//the biggest inner child (by surface area) is replaced by its own children until there are 4
+int BVHTree::collapseNode(const vector<BVHBuildNode>& binary, int index, vector<BVHNode>& list)
+{
+	int slots[4] = { index + 1, binary[index].offset, -1, -1 };
+	int numSlots = 2;
+	while (numSlots < 4)
+	{
+		int widest = -1;
+		for (int i = 0; i < numSlots; i++)
+		{
+			const BVHBuildNode& node = binary[slots[i]];
+			if (node.numPrimitives == 0 && (widest < 0 || node.box.getSurfaceArea() > binary[slots[widest]].box.getSurfaceArea()))
+				widest = i;
+		}
+		if (widest < 0)
+			break;
 
-	int backSize = numTriangles / 2;
-	int frontSize = numTriangles - backSize;
+		int opened = slots[widest];
+		slots[widest] = opened + 1;
+		slots[numSlots++] = binary[opened].offset;
+	}
 
-	BVHNode* backNode = new BVHNode(NIL, NIL);
-	node->back = backNode;
-	buildNode(backNode, indices, backSize, mesh);
+	int current = list.size();
+	list.push_back(BVHNode());
+	for (int i = 0; i < 4; i++)
+	{
+		//unused slots get an empty box (lower > upper), which no ray can hit
+		const BVHBuildNode* node = (i < numSlots) ? &binary[slots[i]] : NULL;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			list[current].lower[axis][i] = node ? node->box.lower[axis] : INFINITY;
+			list[current].upper[axis][i] = node ? node->box.upper[axis] : -INFINITY;
+		}
+		list[current].child[i] = node ? node->offset : -1;
+		list[current].count[i] = node ? node->numPrimitives : 0;
+	}
 
-	BVHNode* frontNode = new BVHNode(NIL, NIL);
-	node->front = frontNode;
-	buildNode(frontNode, indices + backSize, frontSize, mesh);
+	//"list" grows while collapsing children, so no reference into it is kept
+	for (int i = 0; i < numSlots; i++)
+	{
+		if (binary[slots[i]].numPrimitives == 0)
+		{
+			int child = collapseNode(binary, slots[i], list);
+			list[current].child[i] = child;
+		}
+	}
+	return current;
 }
 
-void BVH::build(const Mesh& mesh)
+void BVHTree::buildTree(const Box* boxes, int numPrimitives, int groupSize, int numThreads)
 {
-	int numTriangles = mesh.t.size();
-
-	allIndices = new int[numTriangles];
-	for (int i = 0; i < numTriangles; i++)
-		allIndices[i] = i;
+	vector<int> indices(numPrimitives);
+	for (int i = 0; i < numPrimitives; i++)
+		indices[i] = i;
+
+	allBoxes = boxes;
+	leafGroupSize = groupSize;
+
+	//binary tree first, then 4-wide nodes
+	//large trees are built on several threads, the result is exactly the same tree
+	vector<BVHBuildNode> binary;
+	binary.reserve(2 * numPrimitives / BVHMAXLEAFSIZE + 1);
+	if (numPrimitives >= BVHPARALLELSIZE && numThreads != 1)
+	{
+		BVHBuildTask root;
+		root.first = 0;
+		root.numPrimitives = numPrimitives;
+		root.depth = 0;
+		{
+			ThreadPool pool(numThreads);
+			int* data = indices.data();
+			pool.submit([this, &pool, &root, data](int) {
+				buildTask(pool, &root, data);
+			});
+			pool.wait();
+		}
+		appendTask(&root, binary);
+	}
+	else if (numPrimitives > 0)
+		buildNode(binary, indices.data(), 0, numPrimitives, 0);
 
-	allBoxes = new Box[numTriangles];
-	computeAllBoundingBoxes(numTriangles, mesh);
+	allBoxes = NULL;
 
-	buildNode(root, allIndices, numTriangles, mesh);
+	vector<BVHNode> list;
+	list.reserve(binary.size() / 3 + 1);
+	if (binary.size() == 1)
+	{
+		//a single leaf, the root gets it as its only child
+		list.push_back(BVHNode());
+		for (int i = 0; i < 4; i++)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				list[0].lower[axis][i] = (i == 0) ? binary[0].box.lower[axis] : INFINITY;
+				list[0].upper[axis][i] = (i == 0) ? binary[0].box.upper[axis] : -INFINITY;
+			}
+			list[0].child[i] = (i == 0) ? 0 : -1;
+			list[0].count[i] = (i == 0) ? numPrimitives : 0;
+		}
+	}
+	else if (binary.size() > 1)
+		collapseNode(binary, 0, list);
 
-	delete[] allBoxes;
-	allBoxes = NULL;
+	allIndices.assign(move(indices));
+	nodes.assign(move(list));
 }
 
-void BVH::intersect(const Ray& ray)
+Box BVHTree::getBoundingBox() const
 {
-	intersectNode(root, ray);
+	if (nodes.size() == 0)
+		return Box();
+
+	const BVHNode& root = nodes[0];
+	Box box;
+	for (int i = 0; i < 4; i++)
+	{
+		if (root.child[i] < 0)
+			continue;
+		Box childBox(Vector3f(root.lower[0][i], root.lower[1][i], root.lower[2][i]),
+			Vector3f(root.upper[0][i], root.upper[1][i], root.upper[2][i]));
+		if (i == 0)
+			box = childBox;
+		else
+			box.expand(childBox);
+	}
+	return box;
 }
 
-void BVH::free(BVHNode* parent)
+void BVHTree::serialize(ByteWriter& writer, int numPrimitives) const
 {
-	if (parent->front != NIL)
-		free(parent->front);
-	if (parent->back != NIL)
-		free(parent->back);
-
-	delete parent;
+	writer.writeAligned(allIndices.data(), numPrimitives);
+	writer.writeVector(nodes);
 }
 
-bool BVH::intersectNode(BVHNode* node, const Ray& ray)
+void BVHTree::deserialize(ByteReader& reader, int numPrimitives)
 {
-	bool hasHit;
-	float tstart;
-	float tend;
+	reader.readVector(allIndices);
+	if ((int)allIndices.size() != numPrimitives)
+		throw runtime_error("BVH does not match its primitives in scene buffer");
 
-	tie(hasHit, tstart, tend) = node->box.intersect(ray);
-
-	if (!hasHit)
-		return false;
-
-	if (node->isLeaf)
+	reader.readVector(nodes);
+	int numNodes = nodes.size();
+	for (int i = 0; i < numNodes; i++)
 	{
-		bool hasHit = false;
-		int numTriangles = node->size;
-		int* targetIndices = node->triangles;
-		for (int i = 0; i < numTriangles; i++)
+		for (int k = 0; k < 4; k++)
 		{
-			termFunc(targetIndices[i], arg);
-			hasHit |= (bool)arg[1];
+			int child = nodes[i].child[k];
+			int count = nodes[i].count[k];
+			bool ok = (count > 0) ? (child >= 0 && child + count <= numPrimitives)
+				: (count == 0 && (child == -1 || (child > i && child < numNodes)));
+			if (!ok)
+				throw runtime_error("illegal BVH node in scene buffer");
 		}
-		return hasHit;
 	}
-
-	hasHit = false;
-	hasHit |= intersectNode(node->front, ray);
-	hasHit |= intersectNode(node->back, ray);
-	return hasHit;
-}
\ No newline at end of file
+}
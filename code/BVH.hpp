@@ -1,94 +1,304 @@
-//bounding volume hierarchy for triangle mesh intersection
+//bounding volume hierarchy over primitives given by their boxes (triangles of a mesh, objects of a group, light objects)
 #pragma once
 #include <vector>
 #include <iostream>
+#include <cmath>
+#include <xmmintrin.h>
 
 #include "Box.hpp"
+#include "Ray.hpp"
+#include "Hit.hpp"
+#include "Serializer.hpp"
 
 using namespace std;
 
-struct Trig;
-class Mesh;
+class ThreadPool;
+struct BVHBuildTask;
 
-class BVHNode
+//binary node, only used while building
+struct BVHBuildNode
 {
-	friend class BVH;
-
-	//bounding box
 	Box box;
 
-	BVHNode* back;
-	BVHNode* front;
-
-	//store all triangle indices (real triangles stored in Mesh)
-	int* triangles = NULL;
+	//leaf: first primitive in "allIndices"
+	//inner node: index of the second child, the first one directly follows
+	int offset;
 
-	int size = 0;
+	//number of primitives of a leaf, 0 for inner nodes
+	int numPrimitives;
+};
 
-	bool isLeaf = false;
-	bool splitDim = 0;
+//node with up to 4 children, whose boxes are stored axis by axis so that all 4 are tested at once (SSE)
+//two cache lines, nodes are stored depth-first
+struct alignas(64) BVHNode
+{
+	//child boxes: lower[axis][child], upper[axis][child]
+	float lower[3][4];
+	float upper[3][4];
 
-	BVHNode(BVHNode* b, BVHNode* f) : back(b), front(f)
-	{}
+	//inner child: node index
+	//leaf child: first primitive in "allIndices"
+	//unused slot: -1 (with an empty box)
+	int child[4];
 
-	~BVHNode()
-	{}
+	//number of primitives of a leaf child, 0 otherwise
+	int count[4];
 };
 
-class BVH
+static_assert(sizeof(BVHNode) == 128, "BVHNode should fill two cache lines");
+
+//deepest binary tree the builder produces (see SAHDEPTH in BVH.cpp)
+static constexpr int BVHMAXDEPTH = 64;
+
+//every 4-wide node pushes at most 4 children in place of itself
+static constexpr int BVHSTACKSIZE = 3 * BVHMAXDEPTH + 1;
+
+//the part of a hierarchy that does not depend on the primitives: building, serializing, the nodes
+class BVHTree
 {
-	BVHNode* root;
-	BVHNode* NIL;
+	const Box* allBoxes;	//bounding boxes of all primitives, only while building
 
-	int* allIndices;	//a large array for in-place computation
+	int leafGroupSize;		//primitives tested together in a leaf, only while building
 
-	Box* allBoxes;		//bounding boxes for all triangles, temporary
+	int splitNode(const Box& box, int* primitives, int numPrimitives, int depth) const;
 
-	void free(BVHNode* parent);
+	int buildNode(vector<BVHBuildNode>& list, int* indices, int first, int numPrimitives, int depth) const;
 
-	bool intersectNode(BVHNode* node, const Ray& ray);
+	void buildTask(ThreadPool& pool, BVHBuildTask* task, int* indices) const;
 
-	void buildNode(BVHNode* node, int* indices, int numTriangles, const Mesh& mesh);
+	static void appendTask(const BVHBuildTask* task, vector<BVHBuildNode>& list);
+
+	int collapseNode(const vector<BVHBuildNode>& binary, int index, vector<BVHNode>& list);
+
+	bool findSplit(const Box& box, const Box& centers, int* indices, int numPrimitives, bool mustSplit, int& splitDim, int& splitBin) const;
+
+	static int binIndex(const Box& primitive, int dim, float lowest, float extent);
+
+	//number of tests for "numPrimitives" primitives in a leaf
+	int groupCount(int numPrimitives) const
+	{
+		return (numPrimitives + leafGroupSize - 1) / leafGroupSize;
+	}
 
-	void splitTriangles(float* mids, int* indices, int numTriangles);
+	Box computeBoundingBox(int* indices, int numPrimitives) const;
 
-	void computeAllBoundingBoxes(int numTriangles, const Mesh& mesh);
+protected:
+	SharedArray<BVHNode> nodes;		//all nodes, root first
 
-	Box computeBoundingBox(int* indices, int numTriangles, const Mesh& mesh);
+	SharedArray<int> allIndices;	//primitive indices of all leaves, reordered in place while building
 
-	Box computeBoundingBox(const Trig& triangle, const Mesh& mesh);
+	//primitive i is covered by boxes[i], "boxes" is only used while building
+	//the surface area heuristic prefers leaves that fill whole groups of "groupSize" primitives
+	//large trees are built with "numThreads" threads (0 = all hardware threads, see BVHPARALLELSIZE)
+	void buildTree(const Box* boxes, int numPrimitives, int groupSize, int numThreads);
 
 public:
-	BVH()
+	BVHTree()
 	{
-		arg = NULL;
-		termFunc = NULL;
-		allIndices = NULL;
 		allBoxes = NULL;
+		leafGroupSize = 1;
+	}
+
+	//box of the root, covers every primitive
+	Box getBoundingBox() const;
 
-		NIL = new BVHNode(NULL, NULL);
-		root = new BVHNode(NIL, NIL);
+	//call f(first, count) for every leaf, leaves cover the positions [first, first + count)
+	template <class F>
+	void forEachLeaf(F f) const
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			for (int k = 0; k < 4; k++)
+			{
+				if (nodes[i].count[k] > 0)
+					f(nodes[i].child[k], nodes[i].count[k]);
+			}
+		}
 	}
 
-	~BVH()
+	//primitive at "position" in leaf order, leaves cover consecutive positions
+	int getPrimitive(int position) const
 	{
-		free(root);
-		delete NIL;
+		return allIndices[position];
+	}
+
+	//primitive indices and the node array, both can be used in place by "deserialize"
+	void serialize(ByteWriter& writer, int numPrimitives) const;
+
+	//replace "build" with the result of "serialize", the primitives must be the same
+	void deserialize(ByteReader& reader, int numPrimitives);
+};
+
+//per ray: origin, reciprocal direction and which side of a box is entered first on each axis
+//a zero direction gives an infinite reciprocal, so boxes beside the ray are never entered
+//a NaN or infinite origin or direction (e.g. from a degenerate normal) hits nothing, see "finite"
+struct BVHRay
+{
+	__m128 origins[3];
+	__m128 inverses[3];
+	bool negative[3];
+	bool finite;
 
-		if (allIndices != NULL)
-			delete[] allIndices;
+	BVHRay(const Ray& ray)
+	{
+		const Vector3f& origin = ray.getOrigin();
+		const Vector3f& direction = ray.getDirection();
+		finite = true;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float inverse = 1.0f / direction[axis];
+			origins[axis] = _mm_set1_ps(origin[axis]);
+			inverses[axis] = _mm_set1_ps(inverse);
+			negative[axis] = inverse < 0;
+			finite = finite && isfinite(origin[axis]) && isfinite(direction[axis]);
+		}
 	}
 
-	void build(const Mesh& mesh);
+	//slab test of the 4 child boxes of "node", limited to [tmin, tmax]
+	//returns a bit per child that is hit, "distances" are where the ray enters them
+	//(a NaN from 0 * infinity is the first operand of min/max, so it is ignored)
+	//unused slots may still be reported, callers skip children below 0
+	int test(const BVHNode& node, float tmin, float tmax, float* distances) const
+	{
+		__m128 tnear = _mm_set1_ps(tmin);
+		__m128 tfar = _mm_set1_ps(tmax);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float* nearPlanes = negative[axis] ? node.upper[axis] : node.lower[axis];
+			const float* farPlanes = negative[axis] ? node.lower[axis] : node.upper[axis];
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearPlanes), origins[axis]), inverses[axis]);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farPlanes), origins[axis]), inverses[axis]);
+			tnear = _mm_max_ps(t0, tnear);
+			tfar = _mm_min_ps(t1, tfar);
+		}
+		_mm_storeu_ps(distances, tnear);
+		return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+	}
+};
+
+//leaves are pushed as well, so they are also visited in order and skipped if a nearer hit was found meanwhile
+struct BVHStackEntry
+{
+	int child;
+	int count;
+	float distance;
+};
+
+//hierarchy whose leaves are tested by "Primitive" (e.g. "Mesh", "Group"), the calls are resolved at compile time
+//so the primitive tests are inlined into the traversal. "Primitive" provides:
+//	static constexpr int LEAFGROUPSIZE: primitives it tests together (e.g. 4 triangles with SSE)
+//	Box getPrimitiveBox(int i) const: bounding box of primitive i, only used by "build"
+//	bool intersectLeaf(int first, int count, const Ray& r, Hit& h, float tmin) const:
+//		closest hit among the primitives at positions [first, first + count) (see "getPrimitive"), true if "h" changed
+//	bool occludedLeaf(int first, int count, const Ray& r, float tmin, float tmax) const:
+//		true if any of them lies between tmin and tmax
+//the primitives are passed to every query, so the hierarchy holds no pointer to its owner and can be copied with it
+template <class Primitive>
+class BVH : public BVHTree
+{
+public:
+	void build(const Primitive& primitives, int numPrimitives, int numThreads)
+	{
+		vector<Box> boxes(numPrimitives);
+		for (int i = 0; i < numPrimitives; i++)
+			boxes[i] = primitives.getPrimitiveBox(i);
+		buildTree(boxes.data(), numPrimitives, Primitive::LEAFGROUPSIZE, numThreads);
+	}
+
+	//depth-first with an explicit stack, the 4 children of a node are tested at once and pushed farthest first
+	//nodes farther away than the closest hit so far are skipped
+	//everything lives on the caller's stack, so several threads can intersect at the same time
+	bool intersect(const Primitive& primitives, const Ray& ray, Hit& hit, float tmin) const
+	{
+		if (nodes.size() == 0)
+			return false;
+
+		BVHRay slabs(ray);
+		if (!slabs.finite)
+			return false;
 
-	void intersect(const Ray& ray);
+		bool result = false;
 
-	//arg[0] = pointer to a "Mesh" object
-	//arg[1] = a boolean flag(hit or not) turned into void* 
-	void** arg;
+		BVHStackEntry stack[BVHSTACKSIZE];
+		int top = 0;
+		stack[top++] = { 0, 0, tmin };
 
-	//this is "intersectCall" in Mesh.cpp
-	//use this to detect intersection between triangle and ray, 
-	//because data are stored in "Mesh" object
-	void (*termFunc) (int idx, void** arg);
+		while (top > 0)
+		{
+			BVHStackEntry entry = stack[--top];
+			if (entry.distance > hit.getT())
+				continue;
+
+			if (entry.count > 0)
+			{
+				result |= primitives.intersectLeaf(entry.child, entry.count, ray, hit, tmin);
+				continue;
+			}
+
+			const BVHNode& node = nodes[entry.child];
+			float distances[4];
+			int mask = slabs.test(node, tmin, hit.getT(), distances);
+			if (mask == 0)
+				continue;
+
+			//sort the children that were hit by distance, farthest first
+			int order[4];
+			int numHits = 0;
+			for (int i = 0; i < 4; i++)
+			{
+				if (!(mask & (1 << i)) || node.child[i] < 0)
+					continue;
+				int k = numHits++;
+				while (k > 0 && distances[order[k - 1]] < distances[i])
+				{
+					order[k] = order[k - 1];
+					k--;
+				}
+				order[k] = i;
+			}
+
+			for (int k = 0; k < numHits; k++)
+			{
+				int i = order[k];
+				stack[top++] = { node.child[i], node.count[i], distances[i] };
+			}
+		}
+		return result;
+	}
+
+	//same walk as "intersect", but the first primitive found ends it, so children are not sorted (shadow rays)
+	bool occluded(const Primitive& primitives, const Ray& ray, float tmin, float tmax) const
+	{
+		if (nodes.size() == 0)
+			return false;
+
+		BVHRay slabs(ray);
+		if (!slabs.finite)
+			return false;
+
+		BVHStackEntry stack[BVHSTACKSIZE];
+		int top = 0;
+		stack[top++] = { 0, 0, tmin };
+
+		while (top > 0)
+		{
+			BVHStackEntry entry = stack[--top];
+			if (entry.count > 0)
+			{
+				if (primitives.occludedLeaf(entry.child, entry.count, ray, tmin, tmax))
+					return true;
+				continue;
+			}
+
+			const BVHNode& node = nodes[entry.child];
+			float distances[4];
+			int mask = slabs.test(node, tmin, tmax, distances);
+			for (int i = 0; i < 4; i++)
+			{
+				if ((mask & (1 << i)) && node.child[i] >= 0)
+					stack[top++] = { node.child[i], node.count[i], distances[i] };
+			}
+		}
+		return false;
+	}
 };
@@ -4,7 +4,7 @@
 #include <tuple>
 #include <cassert>
 
-#include "Object3d.hpp"
+#include "Ray.hpp"
 #include "vecmath.h"
 
 using namespace std;
@@ -31,7 +31,7 @@ public:
 
 	//returns (hit, tstart, tend)
 	//hit=false: no intersection
-	tuple<bool, float, float> intersect(const Ray& ray)
+	tuple<bool, float, float> intersect(const Ray& ray) const
 	{
 		Vector3f direction = ray.getDirection();
 		Vector3f origin = ray.getOrigin();
@@ -77,7 +77,7 @@ public:
 			tend = min(tend, t2);
 		}
 
-		if (parallel || (tend <= tstart))
+		if (parallel || (tend < tstart))
 			return make_tuple(false, 0, 0);
 		else
 			return make_tuple(true, tstart, tend);
@@ -90,11 +90,39 @@ public:
 	}
 
 	//median of specified dimension
-	float getMid(int dim)
+	float getMid(int dim) const
 	{
 		return (upper[dim] + lower[dim]) / 2.0;
 	}
 
+	//grow this box until it also covers "box"
+	void expand(const Box& box)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			lower[i] = min(lower[i], box.lower[i]);
+			upper[i] = max(upper[i], box.upper[i]);
+		}
+	}
+
+	//grow this box until it also covers "point"
+	void expand(const Vector3f& point)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			lower[i] = min(lower[i], point[i]);
+			upper[i] = max(upper[i], point[i]);
+		}
+	}
+
+	float getSurfaceArea() const
+	{
+		float x = upper[0] - lower[0];
+		float y = upper[1] - lower[1];
+		float z = upper[2] - lower[2];
+		return 2 * (x * y + y * z + z * x);
+	}
+
 	bool overlaps(const Box& box)
 	{
 		if (upper[0] <= box.lower[0]) return false;
@@ -5,9 +5,13 @@
 
 #include "Ray.hpp"
 #include "Vecmath.h"
+#include "Random.hpp"
+#include "Serializer.hpp"
 
 using namespace std;
 
+enum camera_type { PERSPECTIVE, DOF };
+
 class Camera 
 {
     public:
@@ -23,8 +27,9 @@ class Camera
         }
 
         // Generate rays for each screen-space coordinate
-        virtual Ray generateRay(int x, int y) = 0;
-        virtual Ray generateJittoredRay(int x, int y) = 0;
+        // "random" belongs to the calling thread, cameras are shared by all threads
+        virtual Ray generateRay(int x, int y, Random& random) const = 0;
+        virtual Ray generateJittoredRay(int x, int y, Random& random) const = 0;
 
         virtual ~Camera() = default;
 
@@ -51,6 +56,9 @@ class Camera
 
         virtual float getTMin() const = 0;
 
+        //write type and parameters, "readCamera" in SceneParser.cpp does the opposite
+        virtual void serialize(ByteWriter& writer) const = 0;
+
         void setSize(int imgW, int imgH)
         {
             width = imgW;
@@ -80,7 +88,7 @@ class PerspectiveCamera : public Camera
             Camera(center, direction, up), perspect_angle(angle)
         {}
 
-        Ray generateRay(int x, int y) override
+        Ray generateRay(int x, int y, Random& random) const override
         {
             float fx = height / (2 * tan(perspect_angle / 2.0));
             float fy = fx;
@@ -94,14 +102,10 @@ class PerspectiveCamera : public Camera
             return Ray(center, view);
         }
 
-        Ray generateJittoredRay(int x, int y) override
+        Ray generateJittoredRay(int x, int y, Random& random) const override
         {
-            static random_device rd;
-            static mt19937 gen(rd());
-            uniform_real_distribution<> dis(-0.5, 0.5);
-
-            float jittor1 = dis(gen);
-            float jittor2 = dis(gen);
+            float jittor1 = random.uniform(-0.5, 0.5);
+            float jittor2 = random.uniform(-0.5, 0.5);
 
             float fx = height / (2 * tan(perspect_angle / 2.0));
             float fy = fx;
@@ -119,6 +123,15 @@ class PerspectiveCamera : public Camera
         {
             return 0.0f;
         }
+
+        void serialize(ByteWriter& writer) const override
+        {
+            writer.write<int>(PERSPECTIVE);
+            writer.write(center);
+            writer.write(direction);
+            writer.write(up);
+            writer.write(perspect_angle);
+        }
 };
 
 //achieves depth of field effect
@@ -129,7 +142,7 @@ class DOFCamera : public Camera
 
     float perspectAngle;
 
-    Vector3f generatePrimaryRay(int x, int y)
+    Vector3f generatePrimaryRay(int x, int y) const
     {
         float fx = height / (2 * tan(perspectAngle / 2.0));
         float fy = fx;
@@ -141,14 +154,10 @@ class DOFCamera : public Camera
         return result.normalized();
     }
 
-    Vector3f generateJittoredPrimaryRay(int x, int y)
+    Vector3f generateJittoredPrimaryRay(int x, int y, Random& random) const
     {
-        static random_device rd;
-        static mt19937 gen(rd());
-        uniform_real_distribution<> dis(-0.5, 0.5);
-
-        float jittor1 = dis(gen);
-        float jittor2 = dis(gen);
+        float jittor1 = random.uniform(-0.5, 0.5);
+        float jittor2 = random.uniform(-0.5, 0.5);
 
         float fx = height / (2 * tan(perspectAngle / 2.0));
         float fy = fx;
@@ -160,14 +169,10 @@ class DOFCamera : public Camera
         return result.normalized();
     }
 
-    Vector3f sampleAperture()
+    Vector3f sampleAperture(Random& random) const
     {
-        static random_device rd;
-        static mt19937 gen(rd());
-        uniform_real_distribution<> dis(-1, 1);
-
-        float x = dis(gen);
-        float y = dis(gen);
+        float x = random.uniform(-1, 1);
+        float y = random.uniform(-1, 1);
 
         return (x * horizontal + y * up).normalized() * aperture;
     }
@@ -183,7 +188,7 @@ public:
         Camera(center, direction, up), perspectAngle(angle), focalLength(focal), aperture(aper)
     {}
 
-    Ray generateRay(int x, int y) override
+    Ray generateRay(int x, int y, Random& random) const override
     {
         //generate primary ray
         Vector3f primary = generatePrimaryRay(x, y);
@@ -192,22 +197,22 @@ public:
         Vector3f C = center + primary * focalLength;
 
         //calculate new center and direction
-        Vector3f newCenter = center + sampleAperture();
+        Vector3f newCenter = center + sampleAperture(random);
         Vector3f newDir = (C - newCenter).normalized();
 
         return Ray(newCenter, newDir);
     }
 
-    Ray generateJittoredRay(int x, int y) override
+    Ray generateJittoredRay(int x, int y, Random& random) const override
     {
         //generate primary ray
-        Vector3f primary = generateJittoredPrimaryRay(x, y);
+        Vector3f primary = generateJittoredPrimaryRay(x, y, random);
 
         //calculate convergence point
         Vector3f C = center + primary * focalLength;
 
         //calculate new center and direction
-        Vector3f newCenter = center + sampleAperture();
+        Vector3f newCenter = center + sampleAperture(random);
         Vector3f newDir = (C - newCenter).normalized();
 
         return Ray(newCenter, newDir);
@@ -217,4 +222,15 @@ public:
     {
         return 0.0f;
     }
+
+    void serialize(ByteWriter& writer) const override
+    {
+        writer.write<int>(DOF);
+        writer.write(center);
+        writer.write(direction);
+        writer.write(up);
+        writer.write(perspectAngle);
+        writer.write(focalLength);
+        writer.write(aperture);
+    }
 };
\ No newline at end of file
@@ -14,17 +14,32 @@ static constexpr int SAMPLERATE = 10;
 static constexpr float EPSILON = 0.01;				//prevent self intersection
 static constexpr float FALLOFF = 0.25;				//falloff for secondary rays
 static constexpr int MAXDEPTH = 100;			
-static constexpr float STOPPROBABILITY = 0.5;
+static constexpr int ROULETTEDEPTH = 5;				//bounces before Russian roulette may end a path
+static constexpr float SURVIVALPROBABILITY = 0.95;	//Russian roulette: highest chance for a path to go on (it follows the path's throughput)
+static constexpr bool STOCHASTICFRESNEL = false;	//glass/Phong: follow reflection or refraction (chosen by the Fresnel term) instead of both, "--fresnel" overrides it
+static constexpr int RAYBUDGET = 0;					//most secondary rays per camera sample (0 = no limit), "--ray-budget" overrides it
+static constexpr int LIGHTSAMPLES = 1;				//samples per light object at every shading point (0 = only bounces find them), "--light-samples" overrides it
 
 // accelerating
 static constexpr bool USEMPI = true;		
+static constexpr int NUMTHREADS = 0;				//0 = all hardware threads, "--threads" overrides it
+static constexpr int TILESIZE = 16;					//tile width/height for parallel rendering, "--tile-size" overrides it
+static constexpr int TILEORDER = 2;					//0 = row by row, 1 = Morton, 2 = Hilbert (see "Tile.hpp"), "--tile-order" overrides it
+static constexpr int TILESPERMESSAGE = 8;			//finished tiles sent to process 0 in one message
+static constexpr bool SAMPLEPARALLEL = false;		//MPI: every process renders the whole image with its own samples, "--sample-parallel" turns it on
+static constexpr int REDUCEINTERVAL = 16;			//sample-parallel: samples per pixel rendered by each process between two reductions
+static constexpr int CHECKPOINTINTERVAL = 64;		//samples per pixel between two checkpoints ("--checkpoint"), MPI saves one at every reduction
+static constexpr int BVHMAXLEAFSIZE = 8;			//BVH: most triangles in a leaf, smaller leaves are chosen by the surface area heuristic
+static constexpr int BVHBINS = 16;					//BVH: candidate split planes per axis for the surface area heuristic
+static constexpr int BVHPARALLELSIZE = 65536;		//BVH: larger hierarchies are built with the rendering threads ("--threads")
 
 // choose input/output file
 static constexpr int CHOICE = 0;
 
 // edit this when you want to add new files or change filename
 // all input/output files must be in the "input/output" directory
-static const char* inputFiles[] =
+// "inline": a single copy for the whole program, not one per file that includes this header
+inline const char* inputFiles[] =
 {
 	"scene0_glass.scene",
 	"scene1_ball.scene",
@@ -37,7 +52,7 @@ static const char* inputFiles[] =
 	"scene6_eagle.scene",
 };
 
-static const char* outputFiles[] =
+inline const char* outputFiles[] =
 {
 	"scene0_glass.bmp",
 	"scene1_ballj.bmp",
@@ -3,6 +3,7 @@
 #include "Object3d.hpp"
 #include "Ray.hpp"
 #include "Hit.hpp"
+#include "BVH.hpp"
 #include <iostream>
 #include <vector>
 
@@ -10,10 +11,62 @@ class Group : public Object3D
 {
 	std::vector<Object3D*> objects;
 
+	//objects with a bounding box are found through "hierarchy" (after "buildHierarchy"),
+	//the rest (infinite planes, objects added later) are tested one by one
+	std::vector<Object3D*> bounded;
+	std::vector<Object3D*> unbounded;
+	BVH<Group> hierarchy;
+
 	public:
+		//"hierarchy" calls these for every leaf that the ray reaches, see "BVH"
+		static constexpr int LEAFGROUPSIZE = 1;
+
+		Box getPrimitiveBox(int i) const
+		{
+			Box box;
+			bounded[i]->getBoundingBox(box);
+			return box;
+		}
+
+		bool intersectLeaf(int first, int count, const Ray& r, Hit& h, float tmin) const
+		{
+			bool hit = false;
+			for (int i = first; i < first + count; i++)
+				hit |= bounded[hierarchy.getPrimitive(i)]->intersect(r, h, tmin);
+			return hit;
+		}
+
+		bool occludedLeaf(int first, int count, const Ray& r, float tmin, float tmax) const
+		{
+			for (int i = first; i < first + count; i++)
+			{
+				if (bounded[hierarchy.getPrimitive(i)]->occluded(r, tmin, tmax))
+					return true;
+			}
+			return false;
+		}
+
 		Group()
 		{}
 
+		//the destructor does not run if the constructor throws, so the objects read so far are deleted here
+		Group(ByteReader& reader)
+		{
+			try
+			{
+				int size = reader.read<int>();
+				for (int i = 0; i < size; i++)
+					addObject(readObject(reader));
+				buildHierarchy(reader.getBuildThreads());
+			}
+			catch (...)
+			{
+				for (auto i : objects)
+					delete i;
+				throw;
+			}
+		}
+
 		~Group() override
 		{
 			for (auto i : objects)
@@ -22,26 +75,98 @@ class Group : public Object3D
 			}
 		}
 
-		bool intersect(const Ray& r, Hit& h, float tmin) override
+		bool intersect(const Ray& r, Hit& h, float tmin) const override
 		{
 			bool hit = false;
-			for (auto obj:objects)
+			for (auto obj : unbounded)
 			{
 				if (obj->intersect(r, h, tmin))
 				{
 					hit = true;
 				}
 			}
+
+			//tested after the planes, so the hierarchy can skip everything behind them
+			if (!bounded.empty())
+				hit |= hierarchy.intersect(*this, r, h, tmin);
 			return hit;
 		}
 
+		bool occluded(const Ray& r, float tmin, float tmax) const override
+		{
+			for (auto obj : unbounded)
+			{
+				if (obj->occluded(r, tmin, tmax))
+					return true;
+			}
+
+			return !bounded.empty() && hierarchy.occluded(*this, r, tmin, tmax);
+		}
+
 		void addObject(Object3D* obj)
 		{
 			objects.push_back(obj);
+			unbounded.push_back(obj);
+		}
+
+		//build a bounding volume hierarchy over all objects with a bounding box (call after the last "addObject")
+		//"numThreads" as in "BVHTree::buildTree"
+		void buildHierarchy(int numThreads)
+		{
+			bounded.clear();
+			unbounded.clear();
+			for (auto obj : objects)
+			{
+				Box box;
+				if (obj->getBoundingBox(box))
+					bounded.push_back(obj);
+				else
+					unbounded.push_back(obj);
+			}
+
+			hierarchy.build(*this, bounded.size(), numThreads);
+		}
+
+		//the group itself is not part of a hit path
+		int getWrapperDepth() const override
+		{
+			int depth = 0;
+			for (auto obj : objects)
+				depth = max(depth, obj->getWrapperDepth());
+			return depth;
 		}
 
-		int getGroupSize()
+		int getGroupSize() const
 		{
 			return objects.size();
 		}
+
+		object_type getType() override
+		{
+			return GROUP;
+		}
+
+		//false if any object is unbounded
+		bool getBoundingBox(Box& box) const override
+		{
+			for (size_t i = 0; i < objects.size(); i++)
+			{
+				Box objectBox;
+				if (!objects[i]->getBoundingBox(objectBox))
+					return false;
+				if (i == 0)
+					box = objectBox;
+				else
+					box.expand(objectBox);
+			}
+			return true;
+		}
+
+		void serialize(ByteWriter& writer) const override
+		{
+			writer.write<int>(GROUP);
+			writer.write<int>(objects.size());
+			for (auto obj : objects)
+				obj->serialize(writer);
+		}
 };
\ No newline at end of file
@@ -6,6 +6,10 @@
 
 class Material;
 class LightObject;
+class Object3D;
+
+//most objects on a hit path: the object that was hit and the transforms/velocities around it
+static constexpr int HITPATHSIZE = 8;
 
 class Hit
 {
@@ -17,6 +21,7 @@ public:
 		t = 1e38;
 		hasTex = false;
 		isLight = false;
+		pathLength = 0;
 	}
 	Hit(float _t, Material* m, const Vector3f& n)
 	{
@@ -26,17 +31,27 @@ public:
 		hasTex = false;
 		isLight = false;
 		lightObject = nullptr;
+		pathLength = 0;
 	}
 	Hit(const Hit& h)
 	{
 		t = h.t;
 		material = h.material;
 		normal = h.normal;
+		texCoord = h.texCoord;
 		hasTex = h.hasTex;
 		isLight = h.isLight;
 		lightObject = h.lightObject;
+		pathLength = h.pathLength;
+		for (int i = 0; i < pathLength; i++)
+			path[i] = h.path[i];
+		primitive = h.primitive;
+		u = h.u;
+		v = h.v;
 	}
 
+	Hit& operator=(const Hit& h) = default;
+
 	~Hit() = default;
 
 	float getT() const
@@ -60,16 +75,43 @@ public:
 		material = m;
 		normal = n;
 		isLight = false;
+		pathLength = 0;
+	}
+
+	//while searching for the closest hit, only remember where it is,
+	//"resolve" computes normal, material and texture coordinate once the closest one is known
+	//"primitive", "u" and "v" mean whatever "object" needs (e.g. triangle index and barycentric coordinates)
+	void setCandidate(float _t, const Object3D* object, int _primitive = 0, float _u = 0, float _v = 0)
+	{
+		t = _t;
+		path[0] = object;
+		pathLength = 1;
+		primitive = _primitive;
+		u = _u;
+		v = _v;
+		isLight = false;
+	}
+
+	//called by a transform or velocity around the candidate on the way out, so "resolve" can undo it
+	//(Transform and Velocity refuse to be nested deeper than the path allows)
+	void addWrapper(const Object3D* wrapper)
+	{
+		if (pathLength > 0 && pathLength < HITPATHSIZE)
+			path[pathLength++] = wrapper;
 	}
 
-	void setLightObject(float _t, LightObject* object)
+	//compute the attributes of a candidate (defined in Object3d.hpp), nothing to do after "set"
+	void resolve(const Ray& ray);
+
+	void setLightObject(float _t, const LightObject* object)
 	{
 		t = _t;
 		lightObject = object;
 		isLight = true;
+		pathLength = 0;
 	}
 
-	LightObject* getLightObject()
+	const LightObject* getLightObject() const
 	{
 		return lightObject;
 	}
@@ -84,9 +126,16 @@ public:
 	Vector3f normal;
 
 	Material* material;
-	LightObject* lightObject;
+	const LightObject* lightObject;
 
 	float t;
 	bool hasTex;
 	bool isLight;
+
+	//candidate, see "setCandidate": path[0] was hit, path[1..] are wrappers around it (innermost first)
+	const Object3D* path[HITPATHSIZE];
+	int pathLength;
+	int primitive;
+	float u;
+	float v;
 };
\ No newline at end of file
@@ -51,6 +51,12 @@ class Image
             data[y * width + x] = color;
         }
 
+        //raw pixels, row by row
+        Vector3f* GetData()
+        {
+            return data;
+        }
+
         //used for anti-aliasing
         void GaussianBlur();
         void DownSampling(const Image& image);
@@ -1,6 +1,7 @@
 #pragma once
 #include "Vector3f.h"
 #include "Object3D.hpp"
+#include "Serializer.hpp"
 
 using namespace std;
 
@@ -20,6 +21,9 @@ class Light
             Vector3f& dir, 
             Vector3f& color,
             float& distanceToLight) const = 0;
+
+        //write type and parameters, "readLight" in SceneParser.cpp does the opposite
+        virtual void serialize(ByteWriter& writer) const = 0;
 };
 
 class DirectionalLight : public Light
@@ -50,6 +54,13 @@ class DirectionalLight : public Light
             return DIRECTIONAL;
         }
 
+        void serialize(ByteWriter& writer) const override
+        {
+            writer.write<int>(DIRECTIONAL);
+            writer.write(direction);
+            writer.write(color);
+        }
+
     private:
 
         DirectionalLight(); // don't use
@@ -88,6 +99,14 @@ class PointLight : public Light
             return POINT;
         }
 
+        void serialize(ByteWriter& writer) const override
+        {
+            writer.write<int>(POINT);
+            writer.write(position);
+            writer.write(color);
+            writer.write(falloff);
+        }
+
     private:
 
         PointLight(); // don't use
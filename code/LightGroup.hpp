@@ -5,6 +5,7 @@
 #include "LightObject.hpp"
 #include "Ray.hpp"
 #include "Hit.hpp"
+#include "BVH.hpp"
 
 using namespace std;
 
@@ -12,6 +13,43 @@ class LightGroup : public LightObject
 {
 	std::vector<LightObject*> light_objects;
 
+	//built by "buildHierarchy", until then every light object is tested
+	//the light objects as seen by "hierarchy" (see "BVH") for one query, "ignored" never blocks a ray
+	struct Leaves
+	{
+		static constexpr int LEAFGROUPSIZE = 1;
+
+		const LightGroup* group;
+		const LightObject* ignored;
+
+		Box getPrimitiveBox(int i) const
+		{
+			return group->light_objects[i]->getBoundingBox();
+		}
+
+		bool intersectLeaf(int first, int count, const Ray& r, Hit& h, float tmin) const
+		{
+			bool hit = false;
+			for (int i = first; i < first + count; i++)
+				hit |= group->light_objects[group->hierarchy.getPrimitive(i)]->intersect(r, h, tmin);
+			return hit;
+		}
+
+		bool occludedLeaf(int first, int count, const Ray& r, float tmin, float tmax) const
+		{
+			for (int i = first; i < first + count; i++)
+			{
+				const LightObject* object = group->light_objects[group->hierarchy.getPrimitive(i)];
+				if (object != ignored && object->occluded(r, tmin, tmax))
+					return true;
+			}
+			return false;
+		}
+	};
+
+	BVH<Leaves> hierarchy;
+	bool hasHierarchy = false;
+
 public:
 	LightGroup()
 	{}
@@ -24,8 +62,11 @@ public:
 		}
 	}
 
-	virtual bool intersect(const Ray& r, Hit& h, float tmin) override
+	virtual bool intersect(const Ray& r, Hit& h, float tmin) const override
 	{
+		if (hasHierarchy)
+			return hierarchy.intersect(Leaves{ this, NULL }, r, h, tmin);
+
 		bool hit = false;
 		for (auto i : light_objects)
 		{
@@ -37,23 +78,79 @@ public:
 		return hit;
 	}
 
-	virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance) override
+	bool occluded(const Ray& r, float tmin, float tmax) const override
+	{
+		return occluded(r, tmin, tmax, NULL);
+	}
+
+	//same, but "ignored" (e.g. the light being sampled) never blocks the ray
+	bool occluded(const Ray& r, float tmin, float tmax, const LightObject* ignored) const
+	{
+		if (hasHierarchy)
+			return hierarchy.occluded(Leaves{ this, ignored }, r, tmin, tmax);
+
+		for (auto i : light_objects)
+		{
+			if (i != ignored && i->occluded(r, tmin, tmax))
+				return true;
+		}
+		return false;
+	}
+
+	//build a bounding volume hierarchy over all light objects (call after the last "addLightObject")
+	//"numThreads" as in "BVHTree::buildTree"
+	void buildHierarchy(int numThreads)
+	{
+		hierarchy.build(Leaves{ this, NULL }, light_objects.size(), numThreads);
+		hasHierarchy = true;
+	}
+
+	Box getBoundingBox() const override
+	{
+		Box box;
+		for (size_t i = 0; i < light_objects.size(); i++)
+		{
+			if (i == 0)
+				box = light_objects[i]->getBoundingBox();
+			else
+				box.expand(light_objects[i]->getBoundingBox());
+		}
+		return box;
+	}
+
+	virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance, float& pdf, Random& random) const override
 	{
 		cout << "Warning: you should not call LightGroup::getIllumination" << endl;
+		pdf = 0;
 		return;
 	}
 
+	virtual float getPdf(const Vector3f& p, const Vector3f& dir, float distance) const override
+	{
+		cout << "Warning: you should not call LightGroup::getPdf" << endl;
+		return 0;
+	}
+
+	void serialize(ByteWriter& writer) const override
+	{
+		writer.write<int>(LIGHTGROUP);
+		writer.write<int>(light_objects.size());
+		for (auto i : light_objects)
+			i->serialize(writer);
+	}
+
 	void addLightObject(LightObject* obj)
 	{
 		light_objects.push_back(obj);
+		hasHierarchy = false;
 	}
 
-	int getLightGroupSize()
+	int getLightGroupSize() const
 	{
 		return light_objects.size();
 	}
 
-	LightObject* getLightObject(int index)
+	LightObject* getLightObject(int index) const
 	{
 		return light_objects[index];
 	}
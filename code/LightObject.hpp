@@ -2,6 +2,11 @@
 
 #include "Vector3f.h"
 #include "Hit.hpp"
+#include "Random.hpp"
+#include "Serializer.hpp"
+#include "Box.hpp"
+
+enum light_object_type { LIGHTTRIANGLE, LIGHTSPHERE, LIGHTGROUP };
 
 class LightObject
 {
@@ -23,17 +28,39 @@ class LightObject
 		virtual ~LightObject() 
 		{}
 
-		virtual bool intersect(const Ray& r, Hit& h, float tmin) = 0;
+		virtual bool intersect(const Ray& r, Hit& h, float tmin) const = 0;
+
+		//true if the light object lies between tmin and tmax (shadow rays)
+		virtual bool occluded(const Ray& r, float tmin, float tmax) const
+		{
+			Hit h(tmax, NULL, Vector3f());
+			return intersect(r, h, tmin);
+		}
+
+		//return a sample point, "random" belongs to the calling thread
+		//points are spread evenly over the surface seen from "p", "pdf" is the density of "dir" per solid angle
+		virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance, float& pdf, Random& random) const = 0;
 
-		//return a sample point
-		virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance) = 0;
+		//density of "dir" in getIllumination, if the light object is "distance" away from "p" in that direction
+		virtual float getPdf(const Vector3f& p, const Vector3f& dir, float distance) const = 0;
 
-		virtual Vector3f getColor()
+		virtual Box getBoundingBox() const = 0;
+
+		//write type and geometry, "readLightObject" in SceneParser.cpp does the opposite
+		virtual void serialize(ByteWriter& writer) const = 0;
+
+		virtual Vector3f getColor() const
 		{
 			return color;
 		}
 
-		virtual int getID()
+		//color of a point "distance" away, as a light sample
+		Vector3f getSampleColor(float distance) const
+		{
+			return color / (1 + falloff * distance * distance);
+		}
+
+		virtual int getID() const
 		{
 			return ID;
 		}
@@ -2,6 +2,7 @@
 #include <random>
 #include <tuple>
 #include <iostream>
+#include <gsl/gsl_math.h>	//M_PI
 
 #include "LightObject.hpp"
 
@@ -12,34 +13,13 @@ class LightSphere : public LightObject
 	Vector3f center;
 	float radius;
 
-	//this is a complicated sampling function, I'm not using it
-	void getComplicatedIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance)
+	//area of the surface seen from "p": a cap that ends where the lines from "p" touch the sphere, or all of it from inside
+	float getVisibleArea(const Vector3f& p) const
 	{
-		//randomly sample a position (must be visible from view point)
-		static random_device rd;
-		static mt19937 gen(rd());
-		uniform_real_distribution<> dis(0, 1);
-
-		//solve visible area geometrically
-		Vector3f center2point = (p - center);
-		float pointDistance = center2point.length();
-		center2point = center2point / pointDistance;
-
-		//theta is the maximum angle between sample direction and point direction
-		float cosTheta = radius / pointDistance;
-		float sinTheta = sqrt(1 - cosTheta * cosTheta);
-
-		//cross a random vector with point direction to get a random perpendicular direction
-		Vector3f randDir(dis(gen), dis(gen), dis(gen));
-		randDir.normalize();
-		randDir = Vector3f::cross(center2point, randDir);
-
-		//now can get a visible random position
-		Vector3f sample = center + cosTheta * center2point + sinTheta * randDir;
-		dir = sample - p;
-		distance = (sample - p).length();
-		dir = dir / distance;
-		col = color / (1 + falloff * distance * distance);
+		float pointDistance = (p - center).length();
+		if (pointDistance <= radius)
+			return 4 * M_PI * radius * radius;
+		return 2 * M_PI * radius * radius * (1 - radius / pointDistance);
 	}
 
 public:
@@ -49,7 +29,7 @@ public:
 		radius = r;
 	}
 
-	virtual bool intersect(const Ray& r, Hit& h, float tmin) override
+	virtual bool intersect(const Ray& r, Hit& h, float tmin) const override
 	{
 		//a*t^2+2b*t+c=0
 		float a = Vector3f::dot(r.getDirection(), r.getDirection());
@@ -72,7 +52,7 @@ public:
 			{
 				Vector3f normal = r.pointAtParameter(t) - center;
 				normal.normalize();
-				h.setLightObject(t, (LightObject*)this);
+				h.setLightObject(t, this);
 				return true;
 			}
 			return false;
@@ -88,34 +68,65 @@ public:
 			{
 				Vector3f normal = r.pointAtParameter(t1) - center;
 				normal.normalize();
-				h.setLightObject(t1, (LightObject*)this);
+				h.setLightObject(t1, this);
 				changed = true;
 			}
 			if (t2 > tmin && t2 < h.getT())
 			{
 				Vector3f normal = r.pointAtParameter(t2) - center;
 				normal.normalize();
-				h.setLightObject(t2, (LightObject*)this);
+				h.setLightObject(t2, this);
 				changed = true;
 			}
 			return changed;
 		}
 	}
 
-	virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance) override
+	virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance, float& pdf, Random& random) const override
 	{
-		//randomly sample a position inside sphere
-		static random_device rd;
-		static mt19937 gen(rd());
-		uniform_real_distribution<> dis(0, 1);
+		//axis from the center towards "p"
+		Vector3f axis = p - center;
+		float pointDistance = axis.length();
+		axis = axis / pointDistance;
 
-		Vector3f randDir(dis(gen), dis(gen), dis(gen));
-		randDir.normalize();
+		//a uniform cosine (around the axis) gives a uniform area, the visible cap starts at radius / pointDistance
+		float minCos = (pointDistance > radius) ? radius / pointDistance : -1.0f;
+		float cosAlpha = minCos + (1 - minCos) * random.uniform();
+		float sinAlpha = sqrt(max(0.0f, 1 - cosAlpha * cosAlpha));
+		float phi = 2 * M_PI * random.uniform();
 
-		Vector3f sample = center + (radius * dis(gen)) * randDir;
+		Vector3f helper = (abs(axis[0]) < 0.9f) ? Vector3f(1, 0, 0) : Vector3f(0, 1, 0);
+		Vector3f tangent = Vector3f::cross(helper, axis).normalized();
+		Vector3f bitangent = Vector3f::cross(axis, tangent);
+
+		Vector3f sample = center + radius * (axis * cosAlpha + tangent * (sinAlpha * cos(phi)) + bitangent * (sinAlpha * sin(phi)));
 		dir = sample - p;
 		distance = (sample - p).length();
 		dir = dir / distance;
-		col = color / (1 + falloff * distance * distance);
+		col = getSampleColor(distance);
+		pdf = getPdf(p, dir, distance);
+	}
+
+	virtual float getPdf(const Vector3f& p, const Vector3f& dir, float distance) const override
+	{
+		Vector3f normal = (p + dir * distance - center) / radius;
+		float cosine = abs(Vector3f::dot(normal, dir));
+		return distance * distance / (getVisibleArea(p) * cosine);
+	}
+
+	Box getBoundingBox() const override
+	{
+		Vector3f extent(radius, radius, radius);
+		return Box(center - extent, center + extent);
+	}
+
+	void serialize(ByteWriter& writer) const override
+	{
+		writer.write<int>(LIGHTSPHERE);
+		writer.write(center);
+		writer.write(color);
+		writer.write(radius);
+		writer.write(falloff);
+		writer.write(ID);
 	}
 };
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <random>
 
 #include "LightObject.hpp"
+#include "Triangle.hpp"
 
 using namespace std;
 
@@ -16,57 +17,25 @@ public:
 		vertices[2] = c;
 	}
 
-	virtual bool intersect(const Ray& ray, Hit& hit, float tmin) override
+	virtual bool intersect(const Ray& ray, Hit& hit, float tmin) const override
 	{
-		Vector3f a = vertices[0];
-		Vector3f b = vertices[1];
-		Vector3f c = vertices[2];
-
-		Vector3f D1 = a - b;
-		Vector3f D2 = a - c;
-		Vector3f D3 = ray.getDirection();
-
-		Matrix3f M(D1, D2, D3, true);
+		const Vector3f& a = vertices[0];
+		Vector3f edge1 = vertices[1] - a;
+		Vector3f edge2 = vertices[2] - a;
 
-		bool issingular;
-		Matrix3f MI = M.inverse(&issingular);
-		if (issingular)
-		{
+		float t, beta, gamma;
+		if (!Triangle::intersectEdges(ray.getOrigin(), ray.getDirection(), a, edge1, edge2, tmin, hit.getT(), t, beta, gamma))
 			return false;
-		}
-		else
-		{
-			//solve for barycentric coordinates
-			Vector3f B = a - ray.getOrigin();
-			Vector3f x = MI * B;
-
-			float beta = x[0];
-			float gamma = x[1];
-			float alpha = 1.0 - beta - gamma;
-			float t = x[2];
-
-			if ((alpha >= 0) && (beta >= 0) && (gamma >= 0) && (t > tmin) && (t < hit.getT()))
-			{
-				hit.setLightObject(t, (LightObject*)this);
 
-				return true;
-			}
-			else
-			{
-				return false;
-			}
-		}
+		hit.setLightObject(t, this);
+		return true;
 	}
 
-	virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance) override
+	virtual void getIllumination(const Vector3f& p, Vector3f& dir, Vector3f& col, float& distance, float& pdf, Random& random) const override
 	{
-		static random_device rd;
-		static mt19937 gen(rd());
-		uniform_real_distribution<> dis(0, 1);
-
 		//sample in a uniform square
-		float rand1 = dis(gen);
-		float rand2 = dis(gen);
+		float rand1 = random.uniform();
+		float rand2 = random.uniform();
 
 		if (rand1 + rand2 > 1.0f)
 		{
@@ -83,7 +52,34 @@ public:
 		dir = sample - p;
 		distance = (sample - p).length();
 		dir = dir / distance;
-		col = color / (1 + falloff * distance * distance);
+		col = getSampleColor(distance);
+		pdf = getPdf(p, dir, distance);
+	}
+
+	//uniform over the area, seen at a slant the same area covers a smaller solid angle (both sides shine)
+	virtual float getPdf(const Vector3f& p, const Vector3f& dir, float distance) const override
+	{
+		Vector3f normal = Vector3f::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]);
+		float area = 0.5f * normal.length();
+		float cosine = abs(Vector3f::dot(normal, dir)) / normal.length();
+		return distance * distance / (area * cosine);
+	}
+
+	Box getBoundingBox() const override
+	{
+		Box box(vertices[0], vertices[0]);
+		box.expand(vertices[1]);
+		box.expand(vertices[2]);
+		return box;
+	}
+
+	void serialize(ByteWriter& writer) const override
+	{
+		writer.write<int>(LIGHTTRIANGLE);
+		writer.writeArray(vertices, 3);
+		writer.write(color);
+		writer.write(falloff);
+		writer.write(ID);
 	}
 
 protected:
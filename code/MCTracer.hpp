@@ -4,6 +4,8 @@
 #include <cmath>
 #include <iostream>
 #include <random>
+#include <climits>
+#include <gsl/gsl_math.h>  //M_PI
 
 #include "SceneParser.hpp"
 #include "Ray.hpp"
@@ -12,102 +14,128 @@
 #include "Group.hpp"
 #include "Material.hpp"
 #include "Light.hpp"
+#include "TraceContext.hpp"
 #include "Configuration.hpp"
 
 using namespace std;
 
 class SceneParser;
 
-//keep track of all refraction indexes along the way and build a BST
-class MCNode
+//part of a path still to be traced
+struct PathSegment
 {
-    friend class MCTracer;
-
-    MCNode* reflect_node;
-    MCNode* refract_node;
-    MCNode* parent = NULL;
+    Vector3f origin;
+    Vector3f direction;
+    Vector3f throughput;    //share of the light coming back along this segment that reaches the camera
+    MediumStack media;      //media the segment travels in
+    int depth;              //bounces since the camera
+    bool falloff;           //fades with the distance to the next object (see "FALLOFF")
+
+    //bounces of ambient and glossy surfaces, which may find a light object that getLocalColor samples too
+    float pdf;              //density of "direction" per solid angle, 0 for the other segments
+    Vector3f lightWeight;   //the throughput at the surface times its "Shade" of a white light along "direction"
+};
 
-    float refraction_index;
+//every bounce before MAXDEPTH leaves at most one segment waiting (the other half of a split path), plus the two of the last split
+struct PathStack
+{
+    PathSegment segments[MAXDEPTH + 2];
+    int size;
 
-public:
-    MCNode(MCNode* reflect, MCNode* refract, float refr)
-    {
-        reflect_node = reflect;
-        refract_node = refract;
-        refraction_index = refr;
-    }
+    //secondary segments this camera sample may still add (see RAYBUDGET)
+    int budget;
 };
 
+//MCTracer is read-only while tracing, all mutable state lives in a TraceContext,
+//so one tracer can be shared by all threads (each with its own context)
 class MCTracer
 {
     //scene settings
-    SceneParser* m_scene;
-    Group* group;
-    LightGroup* lightGroup;
+    const SceneParser* m_scene;
+    const Group* group;
+    const LightGroup* lightGroup;
 
-    //used for recursive ray tracind tree
-    MCNode* root;
-    MCNode* NIL;
+    //glass and Phong: follow either the reflection or the refraction, so a path stays a single chain
+    bool stochasticFresnel;
 
-    //used for Russian roulette
-    float stop_probability;
-    int max_depth;
+    //most secondary rays per camera sample, 0 = no limit
+    int rayBudget;
 
-    //release trace tree memory
-    void free(MCNode* p)
+    //samples per light object and shading point
+    int lightSamples;
+
+    //two unit vectors that form an orthonormal basis with the unit vector "n"
+    static void buildBasis(const Vector3f& n, Vector3f& tangent, Vector3f& bitangent)
     {
-        if (p->reflect_node != NIL)
-            free(p->reflect_node);
-        if (p->refract_node != NIL)
-            free(p->refract_node);
-        delete p;
+        Vector3f axis = (abs(n[0]) < 0.9f) ? Vector3f(1, 0, 0) : Vector3f(0, 1, 0);
+        tangent = Vector3f::cross(axis, n).normalized();
+        bitangent = Vector3f::cross(n, tangent);
     }
-    
-    //produce a random ray direction(used in traceAmbient and traceGlossy)
-    Vector3f randomDir() 
+
+    //random direction on the side of "normal", with probability density cos(theta) / pi
+    //(used in scatterAmbient and scatterGlossy)
+    Vector3f sampleCosine(const Vector3f& normal, TraceContext& context) const
     {
-        static bool firstCall = true;
-        if (firstCall) {
-            srand(time(NULL));
-            firstCall = false;
-        }
+        Random& random = context.random;
+        float r2 = random.uniform();
+        float phi = 2 * M_PI * random.uniform();
+        float r = sqrt(r2);
+
+        Vector3f tangent, bitangent;
+        buildBasis(normal, tangent, bitangent);
+        return (tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * sqrt(1 - r2)).normalized();
+    }
 
-        return Vector3f((rand() / (double)RAND_MAX) * 2 - 1, (rand() / (double)RAND_MAX) * 2 - 1, (rand() / (double)RAND_MAX) * 2 - 1);
+    //power heuristic of multiple importance sampling: share of a sample from a strategy with density "pdf",
+    //if another strategy has density "otherPdf" (both times their number of samples)
+    static float powerHeuristic(float pdf, float otherPdf)
+    {
+        if (isinf(pdf))
+            return 1;
+        if (isinf(otherPdf))
+            return 0;
+        return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
     }
 
-    Vector3f traceReflect(Ray& ray, Hit& hit, MCNode* current, int depth)
+    //add a segment that carries "throughput" of the radiance along "direction" from "origin" back to the camera
+    //"pdf" and "lightWeight" only for bounces that share light objects with getLocalColor (see PathSegment)
+    void push(PathStack& stack, const Vector3f& origin, const Vector3f& direction, const Vector3f& throughput,
+        const MediumStack& media, int depth, bool falloff, float pdf = 0, const Vector3f& lightWeight = Vector3f()) const
     {
-        //perfect reflection
-        Vector3f reflectDir = computeReflect(hit.getNormal(), ray.getDirection(), current);
-        Ray reflectRay(ray.pointAtParameter(hit.getT()), reflectDir);
-        Hit reflectHit;
-        return traceRay(reflectRay, reflectHit, current->reflect_node, depth+1);
+        if (stack.budget <= 0)
+            return;
+        stack.budget--;
+
+        PathSegment& segment = stack.segments[stack.size++];
+        segment.origin = origin;
+        segment.direction = direction;
+        segment.throughput = throughput;
+        segment.media = media;
+        segment.depth = depth;
+        segment.falloff = falloff;
+        segment.pdf = pdf;
+        segment.lightWeight = lightWeight;
     }
 
-    Vector3f traceReflectAndRefract(Ray& ray, Hit& hit, MCNode* current, int depth)
+    //perfect reflection, plus refraction weighted by Schlick's approximation if the material has a refraction index
+    //both are followed, or one of them (see "stochasticFresnel")
+    void scatterReflectAndRefract(const Ray& ray, const Hit& hit, const PathSegment& segment, const Vector3f& throughput, PathStack& stack, TraceContext& context) const
     {
         Material* material = hit.getMaterial();
-        Vector3f reflectDir = computeReflect(hit.getNormal(), ray.getDirection(), current);
-        Ray reflectRay(ray.pointAtParameter(hit.getT()), reflectDir);
-        Hit reflectHit;
-        Vector3f reflectColor = traceRay(reflectRay, reflectHit, current->reflect_node, depth+1);
+        Vector3f point = ray.pointAtParameter(hit.getT());
+        Vector3f reflectDir = computeReflect(hit.getNormal(), ray.getDirection());
 
         if (material->getRefractionIndex() > 0)
         {
-            Vector3f refractDir = computeRefract(hit.getNormal(), ray.getDirection(), current, material->getRefractionIndex());
-            Ray refractRay(ray.pointAtParameter(hit.getT()), refractDir);
-            Hit refractHit;
-            if (refractDir.length() < 0.5)
-            {
-                //no refraction, only reflection
-                return reflectColor;
-            }
-            else
-            {
-                Vector3f refractColor = traceRay(refractRay, refractHit, current->refract_node, depth + 1);
+            //the refracted path enters or leaves the material, the reflected one stays where it is
+            MediumStack refractMedia = segment.media;
+            Vector3f refractDir = computeRefract(hit.getNormal(), ray.getDirection(), material->getRefractionIndex(), refractMedia);
 
-                float n_current = current->refraction_index;
-                float n_next = current->refract_node->refraction_index;
+            //no refraction (total internal reflection) leaves only the reflection
+            if (refractDir.length() >= 0.5)
+            {
+                float n_current = segment.media.top();
+                float n_next = refractMedia.top();
                 float c = (n_current <= n_next) ?
                     abs(Vector3f::dot(ray.getDirection(), hit.getNormal())) :
                     abs(Vector3f::dot(refractDir, hit.getNormal()));
@@ -116,37 +144,42 @@ class MCTracer
                 float R0 = pow(((n_next - n_current) / (n_next + n_current)), 2);
                 float R = R0 + (1 - R0) * pow(1 - c, 5);
 
-                return R * reflectColor + (1 - R) * refractColor;
+                //reflect with probability R, refract otherwise, the chosen part carries all of the throughput,
+                //so the expected color is the same as following both (also when the budget is too small for both)
+                if (stochasticFresnel || stack.budget < 2)
+                {
+                    if (context.random.uniform() < R)
+                        push(stack, point, reflectDir, throughput, segment.media, segment.depth + 1, false);
+                    else
+                        push(stack, point, refractDir, throughput, refractMedia, segment.depth + 1, false);
+                    return;
+                }
+
+                push(stack, point, reflectDir, R * throughput, segment.media, segment.depth + 1, false);
+                push(stack, point, refractDir, (1 - R) * throughput, refractMedia, segment.depth + 1, false);
+                return;
             }
         }
-        else
-        {
-            return reflectColor;
-        }
+        push(stack, point, reflectDir, throughput, segment.media, segment.depth + 1, false);
     }
 
-    Vector3f traceAmbient(Ray& ray, Hit& hit, MCNode* current, int depth)
+    //random direction on the outer side of the surface, the segment fades with the distance it travels
+    //cosine-weighted like a diffuse (Lambertian) surface, whose BRDF * cos / pdf is 1, so the throughput stays as it is
+    void scatterAmbient(const Ray& ray, const Hit& hit, const PathSegment& segment, const Vector3f& throughput, PathStack& stack, TraceContext& context) const
     {
-        //generate a random reflect ray and make it points outward
-        Vector3f reflectDir = randomDir();
-        if (Vector3f::dot(hit.getNormal(), reflectDir) < 0)
-            reflectDir = -reflectDir;
-
-        Ray reflectRay(ray.pointAtParameter(hit.getT()), reflectDir);
-        Hit reflectHit;
-
-        MCNode* reflect_node = new MCNode(NIL, NIL, current->refraction_index);
-        current->reflect_node = reflect_node;
-        reflect_node->parent = current;
+        Vector3f reflectDir = sampleCosine(hit.getNormal(), context);
 
-        Vector3f traceColor = traceRay(reflectRay, reflectHit, current->reflect_node, depth + 1);
-        float distance = reflectHit.getT();
+        //a degenerate triangle has no normal (NaN), so there is no direction either
+        float cosine = Vector3f::dot(hit.getNormal(), reflectDir);
+        if (!(cosine > 0))
+            return;
 
-        return traceColor / (1+FALLOFF * distance * distance);
+        Vector3f lightWeight = Vector3f::pointwiseDot(throughput, hit.getMaterial()->Shade(ray, hit, reflectDir, Vector3f(1, 1, 1)));
+        push(stack, ray.pointAtParameter(hit.getT()), reflectDir, throughput, segment.media, segment.depth + 1, true, cosine / M_PI, lightWeight);
     }
 
     //Cook-Torrance BRDF function that take roughness into account
-    Vector3f CookTorrance(const Vector3f& normal, const Vector3f& incoming, const Vector3f& reflect, const Vector3f& specularColor, float roughness)
+    Vector3f CookTorrance(const Vector3f& normal, const Vector3f& incoming, const Vector3f& reflect, const Vector3f& specularColor, float roughness) const
     {
         Vector3f N = normal.normalized();
         Vector3f V = -incoming.normalized();
@@ -183,35 +216,88 @@ class MCTracer
         return specularColor * result;
     }
 
-    Vector3f traceGlossy(Ray& ray, Hit& hit, MCNode* current, int depth)
+    //density per solid angle with which scatterGlossy picks "L" on a surface with roughness "m" seen from "V"
+    static float glossyPdf(const Vector3f& N, const Vector3f& V, const Vector3f& L, float m)
     {
-        //generate a random reflect ray
-        Vector3f reflectDir = randomDir();
-        //point out
-        if (Vector3f::dot(hit.getNormal(), reflectDir) < 0)
-            reflectDir = -reflectDir;
+        if (Vector3f::dot(N, L) <= 0)
+            return 0;
+
+        //seen from behind: cosine-weighted
+        if (Vector3f::dot(N, V) <= 0)
+            return Vector3f::dot(N, L) / M_PI;
+
+        //density of the half vector (Beckmann * cos), then of the reflected direction
+        Vector3f H = (V + L).normalized();
+        float cosH = Vector3f::dot(N, H);
+        if (cosH <= 0)
+            return 0;
+        float tan2 = (1 - cosH * cosH) / (cosH * cosH);
+        float D = exp(-tan2 / (m * m)) / (M_PI * m * m * pow(cosH, 4));
+        return D * cosH / (4 * Vector3f::dot(V, H));
+    }
 
-        Ray reflectRay(ray.pointAtParameter(hit.getT()), reflectDir);
-        Hit reflectHit;
+    //like "scatterAmbient", weighted by the Cook-Torrance BRDF averaged over the hemisphere (BRDF / (2 * pi * pdf))
+    //the half vector between the view and the new direction is drawn from the Beckmann distribution of the material's roughness,
+    //so most directions fall into the highlight where the BRDF is large
+    void scatterGlossy(const Ray& ray, const Hit& hit, const PathSegment& segment, const Vector3f& throughput, PathStack& stack, TraceContext& context) const
+    {
+        Random& random = context.random;
+        const Vector3f& N = hit.getNormal();
+        Vector3f V = -ray.getDirection().normalized();
+        float m = hit.getMaterial()->getRoughness();
 
-        MCNode* reflect_node = new MCNode(NIL, NIL, current->refraction_index);
-        current->reflect_node = reflect_node;
-        reflect_node->parent = current;
+        Vector3f reflectDir;
+        if (Vector3f::dot(N, V) > 0)
+        {
+            //tan^2 of the angle between half vector and normal, then its direction around the normal
+            float tan2 = -m * m * log(1 - random.uniform());
+            float phi = 2 * M_PI * random.uniform();
+            float cosH = 1 / sqrt(1 + tan2);
+            float sinH = sqrt(1 - cosH * cosH);
+
+            Vector3f tangent, bitangent;
+            buildBasis(N, tangent, bitangent);
+            Vector3f H = tangent * (sinH * cos(phi)) + bitangent * (sinH * sin(phi)) + N * cosH;
+
+            //mirror the view direction at the half vector
+            reflectDir = (H * (2 * Vector3f::dot(V, H)) - V).normalized();
+        }
+        else
+        {
+            //seen from behind, where no half vector is defined
+            reflectDir = sampleCosine(N, context);
+        }
 
-        Vector3f traceColor = traceRay(reflectRay, reflectHit, current->reflect_node, depth + 1);
-        float distance = reflectHit.getT();
+        //below the surface nothing is reflected
+        float pdf = glossyPdf(N, V, reflectDir, m);
+        if (!(pdf > 0))
+            return;
 
-        // Add BRDF function here
-        Vector3f brdf = CookTorrance(hit.getNormal(), ray.getDirection(), reflectDir, hit.getMaterial()->getSpecularColor(), hit.getMaterial()->getRoughness());
+        Vector3f brdf = CookTorrance(N, ray.getDirection(), reflectDir, hit.getMaterial()->getSpecularColor(), m);
+        Vector3f weight = brdf / (2 * M_PI * pdf);
+        if (isnan(weight[0]))
+            cout << "Warning: nan detected" << endl;
+        if (isinf(weight[0]))
+            cout << "Warning: inf detected" << endl;
 
-        // Multiply the traceColor by the BRDF
-        traceColor = Vector3f::pointwiseDot(traceColor, brdf);
+        Vector3f lightWeight = Vector3f::pointwiseDot(throughput, hit.getMaterial()->Shade(ray, hit, reflectDir, Vector3f(1, 1, 1)));
+        push(stack, ray.pointAtParameter(hit.getT()), reflectDir, Vector3f::pointwiseDot(throughput, weight), segment.media, segment.depth + 1, true, pdf, lightWeight);
+    }
 
-        return traceColor / (1 + FALLOFF * distance * distance);
+    //density per solid angle with which the bounce of an ambient or glossy surface follows "dir", 0 for the other materials
+    float getBouncePdf(const Ray& ray, const Hit& hit, const Vector3f& dir) const
+    {
+        const Vector3f& N = hit.getNormal();
+        Material* material = hit.getMaterial();
+        if (material->getType() == AMBIENT)
+            return max(0.0f, Vector3f::dot(N, dir)) / M_PI;
+        if (material->getType() == GLOSSY)
+            return glossyPdf(N, -ray.getDirection().normalized(), dir, material->getRoughness());
+        return 0;
     }
 
-    //call this function to get the color of hitting point
-    Vector3f getLocalColor(Ray& ray, Hit& hit)
+    //call this function to get the color of hitting point, "bounces" if the surface scatters a segment afterwards
+    Vector3f getLocalColor(const Ray& ray, const Hit& hit, bool bounces, TraceContext& context) const
     {
         Material* material = hit.getMaterial();
         Vector3f localColor=material->shadeAmbient(ray, hit, m_scene->getAmbientLight());
@@ -230,55 +316,53 @@ class MCTracer
             light->getIllumination(localPoint, dir2light, lightColor, distance);
 
             //cast shadow rays, dir2light aready normalized
-            Ray shadowRay(localPoint, dir2light);
-            Hit shadowHit;      //blocked by another 3D object
-            Hit shadowLightHit; //blocked by another light object
-
-            bool group_hit = group->intersect(shadowRay, shadowHit, EPSILON);
-            if (group_hit && shadowHit.getT() < distance - EPSILON)
+            //any blocker will do, by another 3D object or by a light object
+            Ray shadowRay(localPoint, dir2light, ray.getTime());
+            context.numRays++;
+            if (group->occluded(shadowRay, EPSILON, distance - EPSILON))
                 continue;
-
-            bool group_lights_hit = group->intersect(shadowRay, shadowLightHit, EPSILON);
-            if (group_lights_hit && shadowLightHit.getT() < distance - EPSILON)
+            if (lightGroup->occluded(shadowRay, EPSILON, distance - EPSILON))
                 continue;
 
             localColor = localColor + material->Shade(ray, hit, dir2light, lightColor);
         }
         
-        //compute local color with 3D light objects
+        //compute local color with 3D light objects, each one spreads its color evenly over the surface it samples
+        //an ambient or glossy bounce may find the same light (see traceSegment), the power heuristic splits it between both
         for (int l = 0; l < lightGroup->getLightGroupSize(); l++)
         {
-            LightObject* object = lightGroup->getLightObject(l);
-
-            Vector3f lightColor;
-            Vector3f dir2light;
-            float distance = 0;
-            //This function returns a random light sample at the light source
-            object->getIllumination(localPoint, dir2light, lightColor, distance);
+            const LightObject* object = lightGroup->getLightObject(l);
 
-            Ray shadowRay(localPoint, dir2light);
-            Hit shadowHit;      //blocked by another 3D object
-            Hit shadowLightHit; //blocked by another light object
-
-            bool isGroupHit = group->intersect(shadowRay, shadowHit, EPSILON);
-            if (isGroupHit && shadowHit.getT() < distance - EPSILON)
-                continue;
-
-            bool isGroupLightHit = lightGroup->intersect(shadowRay, shadowLightHit, EPSILON);
-            if (isGroupLightHit && shadowLightHit.getLightObject()->getID() != object->getID())
+            for (int s = 0; s < lightSamples; s++)
             {
-                if (shadowLightHit.getT() < distance - EPSILON)
+                Vector3f lightColor;
+                Vector3f dir2light;
+                float distance = 0;
+                float pdf = 0;
+                //This function returns a random light sample at the light source
+                object->getIllumination(localPoint, dir2light, lightColor, distance, pdf, context.random);
+                if (!(pdf > 0))
                     continue;
-            }
 
-            localColor = localColor + material->Shade(ray, hit, dir2light, lightColor);
+                //blocked by another 3D object, or by a light object other than the sampled one
+                Ray shadowRay(localPoint, dir2light, ray.getTime());
+                context.numRays++;
+                if (group->occluded(shadowRay, EPSILON, distance - EPSILON))
+                    continue;
+                if (lightGroup->occluded(shadowRay, EPSILON, distance - EPSILON, object))
+                    continue;
+
+                float bouncePdf = bounces ? getBouncePdf(ray, hit, dir2light) : 0;
+                float weight = powerHeuristic(lightSamples * pdf, bouncePdf) / lightSamples;
+                localColor = localColor + material->Shade(ray, hit, dir2light, lightColor) * weight;
+            }
         }
 
         return localColor;
     }
 
     //compute diffuse color separately, may not be used
-    Vector3f getDiffuseColor(Ray& ray, Hit& hit)
+    Vector3f getDiffuseColor(const Ray& ray, const Hit& hit, TraceContext& context) const
     {
         Vector3f diffuseColor;
         Material* material = hit.getMaterial();
@@ -299,20 +383,9 @@ class MCTracer
                 distance);
 
             //cast shadow rays, dir2light aready normalized
-            Ray shadowRay(ray.pointAtParameter(hit.getT()), dir2light);
-            Hit shadowHit;      //blocked by another 3D object
-            Hit shadowLightHit; //blocked by another light object
-
-            bool group_hit = group->intersect(shadowRay, shadowHit, EPSILON);
-            bool group_lights_hit = group->intersect(shadowRay, shadowLightHit, EPSILON);
-
-            if ((group_hit) || (group_lights_hit))
-            {
-                if ((shadowHit.getT() < distance) || (shadowLightHit.getT() < distance))
-                {
-                    continue;
-                }
-            }
+            Ray shadowRay(ray.pointAtParameter(hit.getT()), dir2light, ray.getTime());
+            if (group->occluded(shadowRay, EPSILON, distance) || lightGroup->occluded(shadowRay, EPSILON, distance))
+                continue;
 
             diffuseColor = diffuseColor + material->shadeDiffuse(ray, hit, dir2light, lightColor);
         }
@@ -320,7 +393,7 @@ class MCTracer
     }
 
     //compute specular color separately, may not be used
-    Vector3f getSpecularColor(Ray& ray, Hit& hit)
+    Vector3f getSpecularColor(const Ray& ray, const Hit& hit, TraceContext& context) const
     {
         Vector3f specularColor;
         Material* material = hit.getMaterial();
@@ -341,20 +414,9 @@ class MCTracer
                 distance);
 
             //cast shadow rays, dir2light aready normalized
-            Ray shadowRay(ray.pointAtParameter(hit.getT()), dir2light);
-            Hit shadowHit;      //blocked by another 3D object
-            Hit shadowLightHit; //blocked by another light object
-
-            bool group_hit = group->intersect(shadowRay, shadowHit, EPSILON);
-            bool group_lights_hit = group->intersect(shadowRay, shadowLightHit, EPSILON);
-
-            if ((group_hit) || (group_lights_hit))
-            {
-                if ((shadowHit.getT() < distance) || (shadowLightHit.getT() < distance))
-                {
-                    continue;
-                }
-            }
+            Ray shadowRay(ray.pointAtParameter(hit.getT()), dir2light, ray.getTime());
+            if (group->occluded(shadowRay, EPSILON, distance) || lightGroup->occluded(shadowRay, EPSILON, distance))
+                continue;
 
             specularColor = specularColor + material->shadeSpecular(ray, hit, dir2light, lightColor);
         }
@@ -362,9 +424,9 @@ class MCTracer
     }
 
     //call this function when a light object is hit
-    Vector3f getLightColor(Ray& ray, Hit& hit)
+    Vector3f getLightColor(const Ray& ray, const Hit& hit) const
     {
-        LightObject* lightObject = hit.getLightObject();
+        const LightObject* lightObject = hit.getLightObject();
         if (lightObject == NULL)
         {
             cout << "Warning: hit.getLightObject() == NULL. Something is wrong" << endl;
@@ -375,133 +437,137 @@ class MCTracer
         return lightObject->getColor();
     }
 
-public:
-    MCTracer(SceneParser* scene, float refr)
-    {
-        m_scene = scene;
-        group = scene->getGroup();
-        lightGroup = scene->getLightGroup();
-        stop_probability = STOPPROBABILITY;
-        max_depth = 0;
-
-        NIL = new MCNode(NULL, NULL, 0.0);
-        root = new MCNode(NIL, NIL, refr);
-    }
-
-    ~MCTracer()
+    //follow one segment: add the light it brings to "color" and the segments it scatters into to "stack"
+    void traceSegment(const PathSegment& segment, float time, Hit& hit, Vector3f& color, PathStack& stack, TraceContext& context) const
     {
-        if (root != NIL)    
-            free(root);
-        delete NIL;
-    }
+        if (segment.depth > context.maxDepth)
+            context.maxDepth = segment.depth;
+        context.numRays++;
 
-    int maximumDepth() const
-    {
-        return max_depth;
-    }
+        Ray ray(segment.origin, segment.direction, time);
+        bool group_intersect = group->intersect(ray, hit, EPSILON);
 
-    Vector3f traceRay(Ray& ray, Hit& hit, MCNode* current = NULL, int depth = 0, float tmin = EPSILON)
-    {
-        if (depth > max_depth)
-            max_depth = depth;
+        //start from the closest object, so only lights in front of it are reported
+        //and the light hierarchy skips everything behind it
+        Hit lightHit = hit;
+        bool light_intersect = lightGroup->intersect(ray, lightHit, EPSILON);
 
-        if (current == NULL)
-            current = root;
+        //secondary rays of ambient and glossy surfaces fade with the distance to the next object
+        Vector3f throughput = segment.throughput;
+        if (segment.falloff)
+            throughput = throughput / (1 + FALLOFF * hit.getT() * hit.getT());
 
-        //clear nodes left by previous traces
-        if (current->reflect_node != NIL)
+        if (!group_intersect && !light_intersect)
         {
-            free(current->reflect_node);
-            current->reflect_node = NIL;
+            color = color + Vector3f::pointwiseDot(throughput, m_scene->getBackgroundColor());
+            return;
         }
-        if (current->refract_node != NIL)
+        if (light_intersect)
         {
-            free(current->refract_node);
-            current->refract_node = NIL;
-        }
-
-        Ray lightRay = ray;
-        Hit lightHit = hit;
-        bool group_intersect = group->intersect(ray, hit, tmin);
-        bool light_intersect = lightGroup->intersect(lightRay, lightHit, tmin);
-
-        if ((group_intersect) || (light_intersect))
-        {
-            if (hit.getT() < lightHit.getT())
+            //hit a light object
+            const LightObject* light = lightHit.getLightObject();
+            if (segment.pdf == 0)
             {
-                //hit a normal object
-                Vector3f localColor = getLocalColor(ray, hit);
-                Material* material = hit.getMaterial();
-
-                //Russian roulette
-                static random_device rd;
-                static mt19937 gen(rd());
-                uniform_real_distribution<> dis(0, 1);
-
-                if ((dis(gen) < stop_probability)&&(depth>5))
-                    return Vector3f::clamp(localColor);
-                
-                if (depth > MAXDEPTH)
-                {
-                    return Vector3f::clamp(localColor);
-                }
-
-                auto materiatlType = material->getType();
-                if (materiatlType == MIRROR)
-                {
-                    return Vector3f::clamp(traceReflect(ray, hit, current, depth));
-                }
-                else if (materiatlType == GLASS)
-                {
-                    Vector3f secondaryColor = traceReflectAndRefract(ray, hit, current, depth);
-                    return Vector3f::clamp(secondaryColor);
-                }
-                else if (materiatlType == AMBIENT)
-                {
-                    Vector3f secondaryColor = traceAmbient(ray, hit, current, depth);
-                    return Vector3f::clamp(localColor + secondaryColor);
-                }
-                else if (materiatlType == PHONG)
-                {
-                    Vector3f secondaryColor = traceReflectAndRefract(ray, hit, current, depth);
-                    secondaryColor = Vector3f::pointwiseDot(secondaryColor, material->getSpecularColor());
-                    return Vector3f::clamp(localColor + secondaryColor);
-                }
-                else if (materiatlType == GLOSSY)
-                {
-                    Vector3f secondaryColor = traceGlossy(ray, hit, current, depth);
-                    if (isnan(secondaryColor[0]))
-                        cout << "Warning: nan detected" << endl;
-                    if (isinf(secondaryColor[0]))
-                        cout << "Warning: inf detected" << endl;
-                    if (secondaryColor[0] < 0)
-                        cout << "Warning: negative color detected" << endl;
-                    return Vector3f::clamp(localColor + secondaryColor);
-                }
+                color = color + Vector3f::pointwiseDot(throughput, light->getColor());
+                return;
             }
-            else
+
+            //an ambient or glossy bounce, it estimates the same light as the samples in getLocalColor:
+            //"Shade" of the light's color at density "lightPdf", weighted by the power heuristic
+            float distance = lightHit.getT();
+            float lightPdf = light->getPdf(segment.origin, segment.direction, distance);
+            if (lightPdf > 0 && !isinf(lightPdf))
             {
-                //hit a light object
-                LightObject* light = lightHit.getLightObject();
-                return light->getColor();
+                float weight = lightPdf / segment.pdf * powerHeuristic(segment.pdf, lightSamples * lightPdf);
+                color = color + Vector3f::pointwiseDot(segment.lightWeight, light->getSampleColor(distance)) * weight;
             }
+            return;
         }
-        else
+
+        //hit a normal object, only the closest one gets a normal and a material
+        hit.resolve(ray);
+        Material* material = hit.getMaterial();
+        auto materiatlType = material->getType();
+
+        //mirrors and glass only pass on what they reflect and refract
+        if (materiatlType == AMBIENT || materiatlType == PHONG || materiatlType == GLOSSY)
         {
-            return m_scene->getBackgroundColor();
+            bool bounces = segment.depth < MAXDEPTH && stack.budget > 0;
+            color = color + Vector3f::pointwiseDot(throughput, getLocalColor(ray, hit, bounces, context));
         }
+
+        if (segment.depth >= MAXDEPTH)
+            return;
+
+        //Russian roulette: a path that carries little light is likely to end, one that carries much is likely to go on
+        //surviving paths carry more to make up for the ones that ended, so the expected color stays the same
+        if (segment.depth >= ROULETTEDEPTH)
+        {
+            float survival = min(max(throughput[0], max(throughput[1], throughput[2])), SURVIVALPROBABILITY);
+            if (context.random.uniform() >= survival)
+                return;
+            throughput = throughput / survival;
+        }
+
+        if (materiatlType == MIRROR)
+            push(stack, ray.pointAtParameter(hit.getT()), computeReflect(hit.getNormal(), ray.getDirection()),
+                throughput, segment.media, segment.depth + 1, false);
+        else if (materiatlType == GLASS)
+            scatterReflectAndRefract(ray, hit, segment, throughput, stack, context);
+        else if (materiatlType == AMBIENT)
+            scatterAmbient(ray, hit, segment, throughput, stack, context);
+        else if (materiatlType == PHONG)
+            scatterReflectAndRefract(ray, hit, segment, Vector3f::pointwiseDot(throughput, material->getSpecularColor()), stack, context);
+        else if (materiatlType == GLOSSY)
+            scatterGlossy(ray, hit, segment, throughput, stack, context);
     }
 
-    Vector3f computeReflect(const Vector3f& normal, const Vector3f& incoming, MCNode* current)
+public:
+    MCTracer(const SceneParser* scene, bool stochastic = STOCHASTICFRESNEL, int budget = RAYBUDGET, int samples = LIGHTSAMPLES)
     {
-        MCNode* reflect_node = new MCNode(NIL, NIL, current->refraction_index);
-        current->reflect_node = reflect_node;
-        reflect_node->parent = current;
+        m_scene = scene;
+        stochasticFresnel = stochastic;
+        rayBudget = budget;
+        lightSamples = samples;
+        group = scene->getGroup();
+        lightGroup = scene->getLightGroup();
+    }
+
+    //trace one camera sample, "context" must belong to the calling thread, "hit" is the first hit
+    //a loop instead of recursion: segments still to be traced wait on a stack (glass splits a path in two),
+    //each with the part of its light that reaches the camera (its throughput)
+    Vector3f traceRay(const Ray& ray, Hit& hit, TraceContext& context) const
+    {
+        context.numSamples++;
 
+        //every sample happens at its own random time (used by Velocity objects)
+        float time = context.random.uniform(-1, 1);
+
+        PathStack stack;
+        stack.size = 0;
+        stack.budget = 1;
+        push(stack, ray.getOrigin(), ray.getDirection(), Vector3f(1, 1, 1), MediumStack(context.outsideIndex), 0, false);
+        stack.budget = (rayBudget > 0) ? rayBudget : INT_MAX;
+
+        Vector3f color;
+        bool first = true;
+        while (stack.size > 0)
+        {
+            PathSegment segment = stack.segments[--stack.size];
+            Hit secondaryHit;
+            traceSegment(segment, time, first ? hit : secondaryHit, color, stack, context);
+            first = false;
+        }
+        return Vector3f::clamp(color);
+    }
+
+    Vector3f computeReflect(const Vector3f& normal, const Vector3f& incoming) const
+    {
         return (incoming - normal * 2 * Vector3f::dot(incoming, normal)).normalized();
     }
 
-    Vector3f computeRefract(const Vector3f& normal, const Vector3f& incoming, MCNode* current, float n_material)
+    //zero for total internal reflection, otherwise "media" become the media behind the surface
+    Vector3f computeRefract(const Vector3f& normal, const Vector3f& incoming, float n_material, MediumStack& media) const
     {
         Vector3f V = incoming;
         Vector3f N = normal;
@@ -511,43 +577,29 @@ public:
         if (V_N < 0)
         {
             //shoot in, use next material's refraction index
-            float n_ratio = current->refraction_index / n_material;
+            float n_ratio = media.top() / n_material;
             float delta = 1.0 - n_ratio * n_ratio * (1.0 - V_N * V_N);
 
             if (delta <= 0)
                 return Vector3f(0, 0, 0);
             else
             {
-                MCNode* refract_node = new MCNode(NIL, NIL, n_material);
-                current->refract_node = refract_node;
-                refract_node->parent = current;
-
+                media.enter(n_material);
                 return (n_ratio * (V - N * V_N) - N * sqrt(delta)).normalized();
             }
         }
         else
         {
-            //shoot out, find the refraction index before shooting in
-            MCNode* p = current->parent;
-            while (p != NULL)
-            {
-                if (p->refraction_index == current->refraction_index)
-                    p = p->parent;
-                else
-                    break;
-            }
-            float n_previous = (p == NULL) ? 1.0 : p->refraction_index;
-            float n_ratio = current->refraction_index / n_previous;
+            //shoot out, back to the medium the path was in before shooting in
+            float n_previous = media.outer();
+            float n_ratio = media.top() / n_previous;
             float delta = 1.0 - n_ratio * n_ratio * (1.0 - V_N * V_N);
 
             if (delta <= 0)
                 return Vector3f(0, 0, 0);
             else
             {
-                MCNode* refract_node = new MCNode(NIL, NIL, n_previous);
-                current->refract_node = refract_node;
-                refract_node->parent = current;
-
+                media.leave();
                 return (n_ratio * (V - N * V_N) + N * sqrt(delta)).normalized();
             }
         }
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <memory>
 
 #include "Material.hpp"
 
@@ -41,6 +42,52 @@ Vector3f Material::getSpecularColor()
 	return specularColor;
 }
 
+void Material::serialize(ByteWriter& writer)
+{
+	writer.write<int>(getType());
+	writer.write(diffuseColor);
+	writer.write(specularColor);
+	writer.write(shininess);
+	writer.write(refractionIndex);
+	writer.write(roughness);
+	texture.serialize(writer);
+}
+
+Material* Material::deserialize(ByteReader& reader)
+{
+	//owned until it is complete, so an error deletes it
+	unique_ptr<Material> answer;
+	int type = reader.read<int>();
+	switch (type)
+	{
+	case PHONG:
+		answer.reset(new Phong(Vector3f::ZERO));
+		break;
+	case GLOSSY:
+		answer.reset(new Glossy(Vector3f::ZERO));
+		break;
+	case AMBIENT:
+		answer.reset(new Ambient(Vector3f::ZERO));
+		break;
+	case MIRROR:
+		answer.reset(new Mirror());
+		break;
+	case GLASS:
+		answer.reset(new Glass(0));
+		break;
+	default:
+		throw runtime_error("unknown material type in scene buffer");
+	}
+
+	answer->diffuseColor = reader.read<Vector3f>();
+	answer->specularColor = reader.read<Vector3f>();
+	answer->shininess = reader.read<float>();
+	answer->refractionIndex = reader.read<float>();
+	answer->roughness = reader.read<float>();
+	answer->texture.deserialize(reader);
+	return answer.release();
+}
+
 Vector3f Material::Shade(const Ray& ray, const Hit& hit, const Vector3f& dirToLight, const Vector3f& lightColor) 
 {
 	Vector3f kd;
@@ -30,6 +30,10 @@ class Material
 		virtual Vector3f getSpecularColor();
 
 		virtual material_type getType()=0;
+
+		//type, colors, coefficients and texture pixels
+		void serialize(ByteWriter& writer);
+		static Material* deserialize(ByteReader& reader);
 	
 	protected:
 		Vector3f diffuseColor;
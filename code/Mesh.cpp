@@ -4,89 +4,202 @@
 #include <cstdlib>
 #include <utility>
 #include <sstream>
+#include <xmmintrin.h>
 
 #include "Mesh.hpp"
 
 using namespace std;
 
-//accelerator will call this function to check triangle intersection
-static void intersectCall(int idx, void** arg)
+//the accelerator calls "intersectLeaf" for every leaf it reaches (inlined, both are in this file)
+bool Mesh::intersect(const Ray& r, Hit& h, float tm) const
 {
-	Mesh* m = (Mesh*)(arg[0]);
-	bool result = m->intersectTrig(idx);
-	arg[1] = (void*)(((bool)arg[1]) | result);
+	return hierarchy.intersect(*this, r, h, tm);
 }
 
-bool Mesh::intersect(const Ray& r, Hit& h, float tm)
+//stops at the first triangle found, no normal or texture coordinate is computed
+bool Mesh::occluded(const Ray& r, float tmin, float tmax) const
 {
-	//store it so that "Mesh::intersectTrig" can use it
-	ray = &r;
-	hit = &h;
-	tmin = tm;
-
-	//how to interact with accelerator? pass self as argument
-	void* arg[2]{};
-	arg[0] = this;
-	arg[1] = 0;
-
-	//accelerator reads arg and uses arg[0] to construct and intersect
-	//accelerator shares "arg" with "Mesh"
-	hierarchy.arg = arg;
-	hierarchy.termFunc = intersectCall;
-	hierarchy.intersect(r);
-	return arg[1];
+	return hierarchy.occluded(*this, r, tmin, tmax);
 }
 
-//intersect a triangle at location "idx"
-bool Mesh::intersectTrig(int idx) 
+//a.x * b.x + a.y * b.y + a.z * b.z on 4 lanes, in the same order as the scalar test
+static inline __m128 dot4(const __m128* a, const __m128* b)
 {
-	Triangle triangle(v[t[idx][0]], v[t[idx][1]], v[t[idx][2]], material);
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+static inline void cross4(const __m128* a, const __m128* b, __m128* result)
+{
+	result[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+	result[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+	result[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+}
+
+//Moller-Trumbore on the 4 triangles of "block", see "Triangle::intersectEdges"
+//returns a bit per triangle hit between "lower" and "upper"
+static inline int testBlock(const TrigBlock& block, const __m128* o, const __m128* d, __m128 lower, __m128 upper,
+	__m128& t, __m128& beta, __m128& gamma)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
 
-	//compute normals
-	if (autoNormal)
+	__m128 vertex[3];
+	__m128 edge1[3];
+	__m128 edge2[3];
+	for (int dim = 0; dim < 3; dim++)
 	{
-		if (smooth)
-		{
-			triangle.normals[0] = n[t[idx][0]];
-			triangle.normals[1] = n[t[idx][1]];
-			triangle.normals[2] = n[t[idx][2]];
-		}
-		else
+		vertex[dim] = _mm_load_ps(block.vertex[dim]);
+		edge1[dim] = _mm_load_ps(block.edge1[dim]);
+		edge2[dim] = _mm_load_ps(block.edge2[dim]);
+	}
+
+	__m128 p[3];
+	cross4(d, edge2, p);
+	__m128 determinant = dot4(edge1, p);
+	__m128 inverse = _mm_div_ps(one, determinant);
+
+	__m128 s[3];
+	for (int dim = 0; dim < 3; dim++)
+		s[dim] = _mm_sub_ps(o[dim], vertex[dim]);
+	beta = _mm_mul_ps(dot4(s, p), inverse);
+
+	__m128 q[3];
+	cross4(s, edge1, q);
+	gamma = _mm_mul_ps(dot4(d, q), inverse);
+	t = _mm_mul_ps(dot4(edge2, q), inverse);
+
+	//ordered comparisons, so NaN lanes fail
+	__m128 inside = _mm_and_ps(_mm_cmpneq_ps(determinant, zero), _mm_cmpge_ps(beta, zero));
+	inside = _mm_and_ps(inside, _mm_cmple_ps(beta, one));
+	inside = _mm_and_ps(inside, _mm_cmpge_ps(gamma, zero));
+	inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_add_ps(beta, gamma), one));
+	inside = _mm_and_ps(inside, _mm_cmpgt_ps(t, lower));
+	inside = _mm_and_ps(inside, _mm_cmplt_ps(t, upper));
+	return _mm_movemask_ps(inside);
+}
+
+//origin and direction of "r" in all 4 lanes
+static inline void broadcastRay(const Ray& r, __m128* o, __m128* d)
+{
+	const Vector3f& origin = r.getOrigin();
+	const Vector3f& direction = r.getDirection();
+	for (int dim = 0; dim < 3; dim++)
+	{
+		o[dim] = _mm_set1_ps(origin[dim]);
+		d[dim] = _mm_set1_ps(direction[dim]);
+	}
+}
+
+//the closest lane of all blocks of the leaf wins, its attributes are computed by "resolve"
+bool Mesh::intersectLeaf(int first, int count, const Ray& r, Hit& h, float tmin) const
+{
+	__m128 o[3];
+	__m128 d[3];
+	broadcastRay(r, o, d);
+	const __m128 lower = _mm_set1_ps(tmin);
+
+	float closest = h.getT();
+	int winner = -1;
+	float winnerBeta = 0;
+	float winnerGamma = 0;
+
+	int firstBlock = leafBlocks[first];
+	int numBlocks = (count + 3) / 4;
+	for (int b = 0; b < numBlocks; b++)
+	{
+		const TrigBlock& block = blocks[firstBlock + b];
+		__m128 t, beta, gamma;
+		int mask = testBlock(block, o, d, lower, _mm_set1_ps(closest), t, beta, gamma);
+		if (mask == 0)
+			continue;
+
+		alignas(16) float dists[4];
+		alignas(16) float betas[4];
+		alignas(16) float gammas[4];
+		_mm_store_ps(dists, t);
+		_mm_store_ps(betas, beta);
+		_mm_store_ps(gammas, gamma);
+		for (int lane = 0; lane < 4; lane++)
 		{
-			triangle.normals[0] = n[idx];
-			triangle.normals[1] = n[idx];
-			triangle.normals[2] = n[idx];
+			if ((mask & (1 << lane)) && dists[lane] < closest)
+			{
+				closest = dists[lane];
+				winner = block.index[lane];
+				winnerBeta = betas[lane];
+				winnerGamma = gammas[lane];
+			}
 		}
 	}
-	else
+
+	if (winner < 0)
+		return false;
+	h.setCandidate(closest, this, winner, winnerBeta, winnerGamma);
+	return true;
+}
+
+bool Mesh::occludedLeaf(int first, int count, const Ray& r, float tmin, float tmax) const
+{
+	__m128 o[3];
+	__m128 d[3];
+	broadcastRay(r, o, d);
+	const __m128 lower = _mm_set1_ps(tmin);
+	const __m128 upper = _mm_set1_ps(tmax);
+
+	int firstBlock = leafBlocks[first];
+	int numBlocks = (count + 3) / 4;
+	for (int b = 0; b < numBlocks; b++)
 	{
-		triangle.normals[0] = n[t[idx].texORnormID[0]];
-		triangle.normals[1] = n[t[idx].texORnormID[1]];
-		triangle.normals[2] = n[t[idx].texORnormID[2]];
+		__m128 t, beta, gamma;
+		if (testBlock(blocks[firstBlock + b], o, d, lower, upper, t, beta, gamma) != 0)
+			return true;
 	}
+	return false;
+}
 
-	if (hasTexture) 
+//normals and texture coordinates are only gathered for the closest hit
+void Mesh::resolve(const Ray& r, Hit& h, int level) const
+{
+	int idx = h.primitive;
+	float beta = h.u;
+	float gamma = h.v;
+	float alpha = 1 - beta - gamma;
+	const Trig& trig = t[idx];
+
+	//interpolate normal vector
+	Vector3f normal;
+	if (autoNormal && !smooth)
+		normal = n[idx];
+	else
 	{
-		triangle.texCoords[0] = texCoord[t[idx].texORnormID[0]];
-		triangle.texCoords[1] = texCoord[t[idx].texORnormID[1]];
-		triangle.texCoords[2] = texCoord[t[idx].texORnormID[2]];
-		triangle.hasTex = true;
+		const int* ids = autoNormal ? trig.x : trig.texORnormID;
+		normal = alpha * n[ids[0]] + beta * n[ids[1]] + gamma * n[ids[2]];
 	}
+	normal.normalize();
+	h.set(h.getT(), material, normal);
 
-	return triangle.intersect(*ray, *hit, tmin);
+	//interpolate texture coordinate
+	if (hasTexture)
+	{
+		Vector2f coord = alpha * texCoord[trig.texORnormID[0]] +
+			beta * texCoord[trig.texORnormID[1]] +
+			gamma * texCoord[trig.texORnormID[2]];
+		h.setTexCoord(coord);
+	}
 }
 
 //parse .obj file
-Mesh::Mesh(const char* filename, Material* material): Object3D(material)
+Mesh::Mesh(const char* filename, Material* material, int numThreads): Object3D(material)
 {
-	ray = NULL;
-	hit = NULL;
-	tmin = 0;
-
 	smooth = false;
 	autoNormal = false;
 	hasTexture = false;
 
+	//filled while parsing, then handed over to the read-only arrays
+	vector<Vector3f> vertices;
+	vector<Trig> triangles;
+	vector<Vector3f> normals;
+	vector<Vector2f> texCoords;
+
 	ifstream f;
 	f.open(filename);
 	if (!f.is_open())
@@ -126,12 +239,12 @@ Mesh::Mesh(const char* filename, Material* material): Object3D(material)
 			//define a vertex 3D coordinate
 			Vector3f vertex;
 			ss >> vertex[0] >> vertex[1] >> vertex[2];
-			v.push_back(vertex);
+			vertices.push_back(vertex);
 		}
 		else if (tok == fTok)
 		{
 			// define a face (triangle or quad)
-			vector<int> vertices, texORnormIDs;
+			vector<int> vertexIDs, texORnormIDs;
 
 			if (line.find(bslash) != string::npos)
 			{
@@ -144,37 +257,37 @@ Mesh::Mesh(const char* filename, Material* material): Object3D(material)
 				int vertex, texORnormal;
 				while (facess >> vertex >> texORnormal)
 				{
-					vertices.push_back(vertex);
+					vertexIDs.push_back(vertex);
 					texORnormIDs.push_back(texORnormal);
 				}
-				if (vertices.size() == 3)	//triangle
+				if (vertexIDs.size() == 3)	//triangle
 				{
 					Trig trig;
-					trig[0] = vertices[0] - 1;
-					trig[1] = vertices[1] - 1;
-					trig[2] = vertices[2] - 1;
+					trig[0] = vertexIDs[0] - 1;
+					trig[1] = vertexIDs[1] - 1;
+					trig[2] = vertexIDs[2] - 1;
 					trig.texORnormID[0] = texORnormIDs[0] - 1;
 					trig.texORnormID[1] = texORnormIDs[1] - 1;
 					trig.texORnormID[2] = texORnormIDs[2] - 1;
-					t.push_back(trig);
+					triangles.push_back(trig);
 				}
 				else	//quad
 				{
 					Trig trig1, trig2;
-					trig1[0] = vertices[0] - 1;
-					trig1[1] = vertices[1] - 1;
-					trig1[2] = vertices[2] - 1;
+					trig1[0] = vertexIDs[0] - 1;
+					trig1[1] = vertexIDs[1] - 1;
+					trig1[2] = vertexIDs[2] - 1;
 					trig1.texORnormID[0] = texORnormIDs[0] - 1;
 					trig1.texORnormID[1] = texORnormIDs[1] - 1;
 					trig1.texORnormID[2] = texORnormIDs[2] - 1;
-					t.push_back(trig1);
-					trig2[0] = vertices[0] - 1;
-					trig2[1] = vertices[2] - 1;
-					trig2[2] = vertices[3] - 1;
+					triangles.push_back(trig1);
+					trig2[0] = vertexIDs[0] - 1;
+					trig2[1] = vertexIDs[2] - 1;
+					trig2[2] = vertexIDs[3] - 1;
 					trig2.texORnormID[0] = texORnormIDs[0] - 1;
 					trig2.texORnormID[1] = texORnormIDs[2] - 1;
 					trig2.texORnormID[2] = texORnormIDs[3] - 1;
-					t.push_back(trig2);
+					triangles.push_back(trig2);
 				}
 			}
 			else 
@@ -183,7 +296,7 @@ Mesh::Mesh(const char* filename, Material* material): Object3D(material)
 				Trig trig;
 				ss >> trig[0] >> trig[1] >> trig[2];
 				trig[0]--; trig[1]--; trig[2]--;
-				t.push_back(trig);
+				triangles.push_back(trig);
 			}
 		}
 		else if (tok == texTok)
@@ -191,38 +304,147 @@ Mesh::Mesh(const char* filename, Material* material): Object3D(material)
 			//define a texture coordinate
 			Vector2f texcoord;
 			ss >> texcoord[0] >> texcoord[1];
-			texCoord.push_back(texcoord);
+			texCoords.push_back(texcoord);
 		}
 		else if (tok == normTok) 
 		{
 			//define a normal
 			Vector3f norm;
 			ss >> norm[0] >> norm[1] >> norm[2];
-			n.push_back(norm);
+			normals.push_back(norm);
 		}
 	}
 	f.close();
 
-	if (n.size() == 0)
+	if (normals.size() == 0)
 	{
 		//no normal specified, automatically compute normals
 		autoNormal = true;
 
-		if (t.size() > 200)
+		if (triangles.size() > 200)
 			smooth = true;
 		else
 			smooth = false;
-		computeNorm();
+		computeNorm(normals, vertices, triangles);
 	}
 
-	if (texCoord.size() > 0)
+	if (texCoords.size() > 0)
 		hasTexture = true;
 
-	hierarchy.build(*this);
+	v.assign(move(vertices));
+	t.assign(move(triangles));
+	n.assign(move(normals));
+	texCoord.assign(move(texCoords));
+
+	//the hierarchy is built over the bounding box of every triangle
+	hierarchy.build(*this, t.size(), numThreads);
+
+	//first vertex and two edges of every triangle, each leaf starts a new block
+	//padding lanes stay zero, a degenerate triangle is never hit
+	int numTriangles = t.size();
+	vector<TrigBlock> trigBlocks;
+	vector<int> firstBlocks(numTriangles, -1);
+	hierarchy.forEachLeaf([&](int first, int count) {
+		firstBlocks[first] = trigBlocks.size();
+		for (int i = 0; i < count; i++)
+		{
+			if (i % 4 == 0)
+			{
+				trigBlocks.push_back(TrigBlock());
+				for (int lane = 0; lane < 4; lane++)
+					trigBlocks.back().index[lane] = -1;
+			}
+			TrigBlock& block = trigBlocks.back();
+			int lane = i % 4;
+			int idx = hierarchy.getPrimitive(first + i);
+			const Vector3f& a = v[t[idx][0]];
+			Vector3f edge1 = v[t[idx][1]] - a;
+			Vector3f edge2 = v[t[idx][2]] - a;
+			for (int dim = 0; dim < 3; dim++)
+			{
+				block.vertex[dim][lane] = a[dim];
+				block.edge1[dim][lane] = edge1[dim];
+				block.edge2[dim][lane] = edge2[dim];
+			}
+			block.index[lane] = idx;
+		}
+	});
+	leafBlocks.assign(move(firstBlocks));
+	blocks.assign(move(trigBlocks));
+}
+
+Mesh::Mesh(ByteReader& reader) : Object3D(reader.readMaterial())
+{
+	smooth = reader.read<bool>();
+	autoNormal = reader.read<bool>();
+	hasTexture = reader.read<bool>();
+
+	reader.readVector(v);
+	reader.readVector(t);
+	reader.readVector(n);
+	reader.readVector(texCoord);
+	reader.readVector(blocks);
+	reader.readVector(leafBlocks);
+
+	//every index that "intersectLeaf" and "resolve" follow
+	if (autoNormal && !smooth && n.size() < t.size())
+		throw runtime_error("illegal normal index in scene buffer");
+	for (size_t i = 0; i < t.size(); i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			if (t[i][k] < 0 || t[i][k] >= (int)v.size())
+				throw runtime_error("illegal vertex index in scene buffer");
+			int normalIndex = autoNormal ? t[i][k] : t[i].texORnormID[k];
+			if (!(autoNormal && !smooth) && (normalIndex < 0 || normalIndex >= (int)n.size()))
+				throw runtime_error("illegal normal index in scene buffer");
+			if (hasTexture && (t[i].texORnormID[k] < 0 || t[i].texORnormID[k] >= (int)texCoord.size()))
+				throw runtime_error("illegal texture coordinate index in scene buffer");
+		}
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		for (int lane = 0; lane < 4; lane++)
+		{
+			if (blocks[i].index[lane] < -1 || blocks[i].index[lane] >= (int)t.size())
+				throw runtime_error("illegal triangle index in scene buffer");
+		}
+	}
+
+	hierarchy.deserialize(reader, t.size());
+
+	//every leaf needs its blocks
+	if (leafBlocks.size() != t.size())
+		throw runtime_error("mesh does not match its triangles in scene buffer");
+	hierarchy.forEachLeaf([&](int first, int count) {
+		int firstBlock = leafBlocks[first];
+		if (firstBlock < 0 || firstBlock + (count + 3) / 4 > (int)blocks.size())
+			throw runtime_error("illegal triangle block in scene buffer");
+	});
+}
+
+void Mesh::serialize(ByteWriter& writer) const
+{
+	writer.write<int>(MESH);
+	writer.writeMaterial(material);
+
+	writer.write(smooth);
+	writer.write(autoNormal);
+	writer.write(hasTexture);
+
+	writer.writeVector(v);
+	writer.writeVector(t);
+	writer.writeVector(n);
+	writer.writeVector(texCoord);
+	writer.writeVector(blocks);
+	writer.writeVector(leafBlocks);
+
+	hierarchy.serialize(writer, t.size());
 }
 
 //compute normal for each vertex
-void Mesh::computeNorm()
+void Mesh::computeNorm(vector<Vector3f>& n, const vector<Vector3f>& v, const vector<Trig>& t)
 {
 	if (smooth) 
 	{
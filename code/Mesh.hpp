@@ -7,6 +7,7 @@
 #include "Vector2f.h"
 #include "Vector3f.h"
 #include "BVH.hpp"
+#include "SharedArray.hpp"
 
 using namespace std;
 
@@ -33,46 +34,93 @@ struct Trig
 	//	else: this Trig's index can be used to access "n"
 };
 
-class Mesh :public Object3D 
+//4 triangles of one BVH leaf, stored component by component so that SSE tests all 4 at once
+//each triangle is its first vertex and two edges (see "Triangle::intersectEdges")
+struct alignas(16) TrigBlock
 {
-	friend class BVH;
+	float vertex[3][4];		//first vertex, [dimension][lane]
+	float edge1[3][4];		//second vertex - first vertex
+	float edge2[3][4];		//third vertex - first vertex
+	int index[4];			//triangle in "t", -1 for padding at the end of a leaf
+};
 
-	//need to store it
-	const Ray* ray;
-	Hit* hit;
-	float tmin;
+static_assert(sizeof(TrigBlock) == 160, "TrigBlock should have no padding");
 
+class Mesh :public Object3D 
+{
 	//if have enough vertices, smooth it
 	bool smooth;
 	bool autoNormal;
 	bool hasTexture;
 
-	void computeNorm();
+	void computeNorm(vector<Vector3f>& normals, const vector<Vector3f>& vertices, const vector<Trig>& triangles);
 
 	//BVH will not calculate intersection by itself.
-	//instead, it lets "Mesh" to calculate a specific triangle for it.
-	BVH hierarchy;
+	//instead, it lets "Mesh" to calculate a specific triangle for it (see "intersectLeaf").
+	BVH<Mesh> hierarchy;
 
 public:
-	Mesh(const char* filename, Material* m);
+	//the BVH is built with "numThreads" threads (0 = all hardware threads)
+	Mesh(const char* filename, Material* m, int numThreads);
+
+	//rebuild a mesh (including its BVH) written by "serialize", nothing is read from disk
+	Mesh(ByteReader& reader);
+
+	virtual bool intersect(const Ray& r, Hit& h, float t) const;
+
+	bool occluded(const Ray& r, float tmin, float tmax) const override;
+
+	//h.primitive = triangle, (h.u, h.v) = barycentric coordinates of its second and third vertex
+	void resolve(const Ray& r, Hit& h, int level) const override;
+
+	//leaves are tested 4 triangles at a time (see "TrigBlock")
+	static constexpr int LEAFGROUPSIZE = 4;
+
+	//bounding box of triangle i
+	Box getPrimitiveBox(int i) const
+	{
+		Box box(v[t[i][0]], v[t[i][0]]);
+		box.expand(v[t[i][1]]);
+		box.expand(v[t[i][2]]);
+		return box;
+	}
+
+	//intersect the triangles at BVH positions [first, first + count), only the closest one sets "h"
+	bool intersectLeaf(int first, int count, const Ray& r, Hit& h, float tmin) const;
 
-	virtual bool intersect(const Ray& r, Hit& h, float t);
-	virtual bool intersectTrig(int idx);
+	//true if any of these triangles lies between tmin and tmax
+	bool occludedLeaf(int first, int count, const Ray& r, float tmin, float tmax) const;
 
 	object_type getType() override
 	{
 		return MESH;
 	}
 
+	bool getBoundingBox(Box& box) const override
+	{
+		box = hierarchy.getBoundingBox();
+		return true;
+	}
+
+	void serialize(ByteWriter& writer) const override;
+
+	//arrays are read-only after construction, a rebuilt mesh may borrow them from a shared scene buffer
+
 	//all 3D vertices
-	std::vector<Vector3f>v;
+	SharedArray<Vector3f>v;
 
 	//all triangles
-	std::vector<Trig>t;
+	SharedArray<Trig>t;
 
 	//all normals
-	std::vector<Vector3f>n;
+	SharedArray<Vector3f>n;
 
 	//all texture coordinates
-	std::vector<Vector2f>texCoord;
+	SharedArray<Vector2f>texCoord;
+
+	//a leaf of n triangles owns (n + 3) / 4 consecutive blocks
+	SharedArray<TrigBlock>blocks;
+
+	//first block of the leaf starting at each BVH position, -1 inside leaves
+	SharedArray<int>leafBlocks;
 };
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include "Ray.hpp"
 #include "Hit.hpp"
 #include "Material.hpp"
+#include "Serializer.hpp"
+#include "Box.hpp"
 
 enum object_type { TRIANGLE, SPHERE, GROUP, MESH, PLANE, TRANSFORM, VELOCITY, OBJECT };
 
@@ -18,13 +20,53 @@ class Object3D
 			this->material = material;
 		}
 
-		virtual bool intersect(const Ray& r, Hit& h, float tmin) = 0;
+		//const: the same object is intersected by many threads at once
+		virtual bool intersect(const Ray& r, Hit& h, float tmin) const = 0;
+
+		//compute normal, material and texture coordinate of a candidate set by "intersect" ("Hit::setCandidate")
+		//"level" is this object's place in the hit path, wrappers transform "r" and pass it on to level - 1
+		virtual void resolve(const Ray& r, Hit& h, int level) const
+		{}
+
+		//transforms and velocities nested inside this object, limited by HITPATHSIZE
+		virtual int getWrapperDepth() const
+		{
+			return 0;
+		}
+
+		//true if anything lies between tmin and tmax (shadow rays), no normal or texture coordinate is computed
+		//by default a closest-hit query limited to tmax
+		virtual bool occluded(const Ray& r, float tmin, float tmax) const
+		{
+			Hit h(tmax, NULL, Vector3f());
+			return intersect(r, h, tmin);
+		}
 
 		virtual object_type getType()
 		{
 			return OBJECT;
 		}
 
+		//box around everything the object may ever cover (for motion: at any time),
+		//false if there is none (e.g. an infinite plane)
+		virtual bool getBoundingBox(Box& box) const = 0;
+
+		//write type, material and geometry, "readObject" does the opposite
+		virtual void serialize(ByteWriter& writer) const = 0;
+
 	protected:
 		Material* material;
-};
\ No newline at end of file
+};
+
+//rebuild an object written by "serialize" (defined in SceneParser.cpp)
+Object3D* readObject(ByteReader& reader);
+
+inline void Hit::resolve(const Ray& ray)
+{
+	if (pathLength == 0)
+		return;
+	int level = pathLength - 1;
+	pathLength = 0;
+	hasTex = false;
+	path[level]->resolve(ray, *this, level);
+}
\ No newline at end of file
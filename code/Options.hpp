@@ -0,0 +1,136 @@
+//runtime options, they override the defaults in "Configuration.hpp"
+#pragma once
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Configuration.hpp"
+
+using namespace std;
+
+struct RenderOptions
+{
+	//number of rendering threads, 0 = all hardware threads
+	int numThreads = NUMTHREADS;
+
+	//tile width/height and the order of tiles (see "Tile.hpp")
+	int tileSize = TILESIZE;
+	int tileOrder = TILEORDER;
+
+	//MPI only: split samples instead of tiles among processes
+	bool sampleParallel = SAMPLEPARALLEL;
+
+	//glass and Phong follow one of reflection and refraction, and the limit of secondary rays per sample (see MCTracer)
+	bool stochasticFresnel = STOCHASTICFRESNEL;
+	int rayBudget = RAYBUDGET;
+
+	//samples per light object at every shading point
+	int lightSamples = LIGHTSAMPLES;
+
+	//base seed of the random numbers, otherwise every run picks a random one
+	bool hasSeed = false;
+	unsigned int seed = 0;
+
+	//checkpoints of the accumulated samples, empty = none
+	string checkpointFile;
+	string resumeFile;
+	vector<string> mergeFiles;
+};
+
+//supported arguments:
+//  -t <n> | --threads <n>    number of rendering threads
+//  --tile-size <n>           tile width/height in pixels
+//  --tile-order <order>      rows | morton | hilbert
+//  --sample-parallel         every MPI process renders the whole image (see SAMPLEPARALLEL)
+//  --fresnel <mode>          split | stochastic: follow both reflection and refraction, or one of them
+//  --ray-budget <n>          at most n secondary rays per camera sample, 0 = no limit
+//  --light-samples <n>       samples per light object at every shading point
+//  --seed <n>                seed of the random numbers, runs with different seeds can be merged
+//  --checkpoint <file>       save the accumulated samples every CHECKPOINTINTERVAL samples per pixel
+//  --resume <file>           continue from a checkpoint (and keep saving to it)
+//  --merge <file>            add up checkpoints (repeat it for every file) and save the image, nothing is rendered
+static RenderOptions parseOptions(int argc, char* argv[])
+{
+	RenderOptions options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		bool hasValue = i + 1 < argc;
+
+		if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) && hasValue)
+		{
+			options.numThreads = atoi(argv[++i]);
+			if (options.numThreads < 0)
+				options.numThreads = 0;
+		}
+		else if (!strcmp(argv[i], "--tile-size") && hasValue)
+		{
+			options.tileSize = atoi(argv[++i]);
+			if (options.tileSize < 1)
+				options.tileSize = 1;
+		}
+		else if (!strcmp(argv[i], "--tile-order") && hasValue)
+		{
+			i++;
+			if (!strcmp(argv[i], "rows"))
+				options.tileOrder = 0;
+			else if (!strcmp(argv[i], "morton"))
+				options.tileOrder = 1;
+			else if (!strcmp(argv[i], "hilbert"))
+				options.tileOrder = 2;
+			else
+				cout << "Warning: ignore unknown tile order " << argv[i] << endl;
+		}
+		else if (!strcmp(argv[i], "--sample-parallel"))
+		{
+			options.sampleParallel = true;
+		}
+		else if (!strcmp(argv[i], "--fresnel") && hasValue)
+		{
+			i++;
+			if (!strcmp(argv[i], "split"))
+				options.stochasticFresnel = false;
+			else if (!strcmp(argv[i], "stochastic"))
+				options.stochasticFresnel = true;
+			else
+				cout << "Warning: ignore unknown Fresnel mode " << argv[i] << endl;
+		}
+		else if (!strcmp(argv[i], "--ray-budget") && hasValue)
+		{
+			options.rayBudget = atoi(argv[++i]);
+			if (options.rayBudget < 0)
+				options.rayBudget = 0;
+		}
+		else if (!strcmp(argv[i], "--light-samples") && hasValue)
+		{
+			options.lightSamples = atoi(argv[++i]);
+			if (options.lightSamples < 0)
+				options.lightSamples = 0;
+		}
+		else if (!strcmp(argv[i], "--seed") && hasValue)
+		{
+			options.hasSeed = true;
+			options.seed = strtoul(argv[++i], NULL, 10);
+		}
+		else if (!strcmp(argv[i], "--checkpoint") && hasValue)
+		{
+			options.checkpointFile = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--resume") && hasValue)
+		{
+			options.resumeFile = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--merge") && hasValue)
+		{
+			options.mergeFiles.push_back(argv[++i]);
+		}
+		else
+		{
+			cout << "Warning: ignore unknown argument " << argv[i] << endl;
+		}
+	}
+
+	return options;
+}
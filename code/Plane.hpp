@@ -19,10 +19,16 @@ class Plane : public Object3D
             D = -d;
         }
 
+        Plane(ByteReader& reader) : Object3D(reader.readMaterial())
+        {
+            N = reader.read<Vector3f>();
+            D = reader.read<float>();
+        }
+
         ~Plane()
         {}
 
-        bool intersect(const Ray& r, Hit& h, float tmin) override
+        bool intersect(const Ray& r, Hit& h, float tmin) const override
         {
             float parallel = Vector3f::dot(N, r.getDirection());
             if (parallel == 0)
@@ -33,10 +39,8 @@ class Plane : public Object3D
 
             if (t > tmin && t < h.getT())
             {
-                if (parallel > 0)
-                    h.set(t, material, -N);
-                else
-                    h.set(t, material, N);
+                //primitive 1: the ray comes from behind
+                h.setCandidate(t, this, parallel > 0);
                 return true;
             }
             else
@@ -45,11 +49,39 @@ class Plane : public Object3D
             }
         }
 
+        void resolve(const Ray& r, Hit& h, int level) const override
+        {
+            h.set(h.getT(), material, h.primitive ? -N : N);
+        }
+
+        bool occluded(const Ray& r, float tmin, float tmax) const override
+        {
+            float parallel = Vector3f::dot(N, r.getDirection());
+            if (parallel == 0)
+                return false;
+            float t = -(D + Vector3f::dot(N, r.getOrigin())) / parallel;
+            return t > tmin && t < tmax;
+        }
+
         object_type getType() override
         {
             return PLANE;
         }
 
+        //infinite, never part of a bounding volume hierarchy
+        bool getBoundingBox(Box& box) const override
+        {
+            return false;
+        }
+
+        void serialize(ByteWriter& writer) const override
+        {
+            writer.write<int>(PLANE);
+            writer.writeMaterial(material);
+            writer.write(N);
+            writer.write(D);
+        }
+
     protected:
         Vector3f N;
         float D;
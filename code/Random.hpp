@@ -0,0 +1,33 @@
+//random number generator owned by a single thread
+#pragma once
+#include <random>
+
+using namespace std;
+
+class Random
+{
+	mt19937 generator;
+
+public:
+	Random(unsigned int seed = 5489u) : generator(seed)
+	{}
+
+	void seed(unsigned int s)
+	{
+		generator.seed(s);
+	}
+
+	//uniform in [0, 1)
+	float uniform()
+	{
+		uniform_real_distribution<float> dis(0, 1);
+		return dis(generator);
+	}
+
+	//uniform in [a, b)
+	float uniform(float a, float b)
+	{
+		uniform_real_distribution<float> dis(a, b);
+		return dis(generator);
+	}
+};
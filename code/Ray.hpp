@@ -8,16 +8,18 @@ class Ray
 {
     public:
         Ray() = delete;
-        Ray(const Vector3f& orig, const Vector3f& dir)
+        Ray(const Vector3f& orig, const Vector3f& dir, float t = 0)
         {
             origin = orig;
             direction = dir;
+            time = t;
         }
 
         Ray(const Ray& r)
         {
             origin = r.origin;
             direction = r.direction;
+            time = r.time;
         }
 
         const Vector3f& getOrigin() const
@@ -35,9 +37,16 @@ class Ray
             return origin + direction * t;
         }
 
+        //sample time in [-1, 1], used for motion blur
+        float getTime() const
+        {
+            return time;
+        }
+
     private:
 
         Vector3f origin;
         Vector3f direction;
+        float time;
 
 };
\ No newline at end of file
@@ -4,6 +4,12 @@
 #include <mpi.h>
 #include <chrono>
 #include <iomanip>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <memory>
 
 #include "SceneParser.hpp"
 #include "Image.hpp"
@@ -12,16 +18,23 @@
 #include "Light.hpp"
 #include "MCTracer.hpp"			//<-- this is the Monte Carlo ray tracing part
 #include "Configuration.hpp"
+#include "Options.hpp"
+#include "ThreadPool.hpp"
+#include "Tile.hpp"
+#include "Accumulator.hpp"
 
 using namespace std;
 
-void printRenderInforation(const SceneParser& sceneParser)
+void printRenderInforation(const SceneParser& sceneParser, int numThreads = 1, int numProcesses = 1)
 {
 	cout << "--- Render Information ---" << endl;
 	cout << "- input filepath    | " << getInputFilePath(inputFiles[CHOICE]) << endl;
 	cout << "- output filepath   | " << getOutputFilePath(outputFiles[CHOICE]) << endl;
 	cout << "- image resolution  | " << WIDTH << " x " << HEIGHT << endl;
 	cout << "- MPI acceleration  | " << (USEMPI ? "true" : "false") << endl;
+	if (USEMPI)
+		cout << "- # processes       | " << numProcesses << endl;
+	cout << "- # threads         | " << numThreads << (USEMPI ? " per process" : "") << endl;
 	cout << "- supersampling     | " << (SUPERSAMPLING ? "true" : "false") << endl;
 	cout << "- jittored sampling | " << (JITTER ? "true" : "false") << endl;
 	cout << "- Gaussian blur     | " << (GAUSSIANBLUR ? "true" : "false") << endl;
@@ -41,61 +54,72 @@ void printRenderInforation(const SceneParser& sceneParser)
 	}
 }
 
-//single-process rendering
-void render()
+//average all samples of pixel (i, j), "context" belongs to the calling thread
+Vector3f renderPixel(int i, int j, const Camera* camera, const MCTracer& tracer, TraceContext& context, int sampleRate, bool needRegenerateRay)
 {
-	auto start = chrono::high_resolution_clock::now();
-
-	//render size(not output size)
-	int width = SUPERSAMPLING ? (WIDTH * 3) : WIDTH;
-	int height = SUPERSAMPLING ? (HEIGHT * 3) : HEIGHT;
-
-	SceneParser sceneParser(inputFiles[CHOICE]);
-	printRenderInforation(sceneParser);
-	if (!sceneParser.checkStatus())
-		return;
-	//for static scene, no need to repeat computation
-	bool needRegenerateRay = sceneParser.hasStochasticCamera();
-	int sampleRate = sceneParser.hasStochasticScene() || needRegenerateRay || JITTER ? SAMPLERATE : 1;
-	
-	Camera* camera = sceneParser.getCamera();
-	camera->setSize(width, height);
-
-	Image img(width, height);
-
-	MCTracer tracer(&sceneParser, 1.0);
-
-	int tenth = (width + 9) / 10;
+	Vector3f color;
+	Ray ray = camera->generateRay(i, j, context.random);
+	for (int k = 0; k < sampleRate; k++)
+	{
+		if (JITTER)
+			ray = camera->generateJittoredRay(i, j, context.random);
+		else if (needRegenerateRay)
+			ray = camera->generateRay(i, j, context.random);
+
+		Hit hit;
+		Vector3f result = tracer.traceRay(ray, hit, context);
+		if (isnan(result[0]))
+			continue;
+		color = color + result;
+	}
+	return color / sampleRate;
+}
 
-	for (int i = 0; i < width; i++)
+//render all pixels inside a tile and store them into "img"
+//"img" is shared by all threads, but tiles never overlap
+void renderTile(const Tile& tile, const Camera* camera, const MCTracer& tracer, TraceContext& context, int sampleRate, bool needRegenerateRay, Image& img)
+{
+	for (int j = tile.y0; j < tile.y1; j++)
 	{
-		if (i%tenth == 0)
+		for (int i = tile.x0; i < tile.x1; i++)
 		{
-			cout << "render column " << setw(4) << i << " / " << setw(4) << width << endl;
+			img.SetPixel(i, j, renderPixel(i, j, camera, tracer, context, sampleRate, needRegenerateRay));
 		}
-		for (int j = 0; j < height; j++)
+	}
+}
+
+//render all pixels inside a tile into "pixels" (row by row, 3 floats per pixel)
+void renderTile(const Tile& tile, const Camera* camera, const MCTracer& tracer, TraceContext& context, int sampleRate, bool needRegenerateRay, float* pixels)
+{
+	for (int j = tile.y0; j < tile.y1; j++)
+	{
+		for (int i = tile.x0; i < tile.x1; i++)
 		{
-			Vector3f color;
-			Ray ray = camera->generateRay(i, j);
-			for (int k = 0; k < sampleRate; k++)
-			{
-				if (JITTER)
-					ray = camera->generateJittoredRay(i, j);
-				else if (needRegenerateRay)
-					ray = camera->generateRay(i, j);
-
-				Hit hit;
-				Vector3f result = tracer.traceRay(ray, hit);
-				if (isnan(result[0]))
-					continue;
-				color = color + result;
-			}
-			color = color / sampleRate;
+			Vector3f color = renderPixel(i, j, camera, tracer, context, sampleRate, needRegenerateRay);
+			*(pixels++) = color[0];
+			*(pixels++) = color[1];
+			*(pixels++) = color[2];
+		}
+	}
+}
 
-			img.SetPixel(i, j, color);
+//render all pixels inside a tile with "samples" samples each and add them to "buffer"
+//"buffer" is shared by all threads, but tiles never overlap
+void accumulateTile(const Tile& tile, const Camera* camera, const MCTracer& tracer, TraceContext& context, int samples, bool needRegenerateRay, Accumulator& buffer)
+{
+	for (int j = tile.y0; j < tile.y1; j++)
+	{
+		for (int i = tile.x0; i < tile.x1; i++)
+		{
+			Vector3f color = renderPixel(i, j, camera, tracer, context, samples, needRegenerateRay);
+			buffer.add(i, j, color * samples, samples);
 		}
 	}
+}
 
+//post-processing, then write the output file
+void saveResult(Image& img)
+{
 	if (GAUSSIANBLUR)
 	{
 		cout << "- start Gaussian blurring" << endl;
@@ -111,337 +135,774 @@ void render()
 	}
 	else
 		img.SaveImage(getOutputFilePath(outputFiles[CHOICE]).c_str());
-
-	auto end = chrono::high_resolution_clock::now();
-	chrono::duration<double> diff = end - start;
-
-	int total_seconds = static_cast<int>(diff.count());
-	int hours = total_seconds / 3600;
-	total_seconds %= 3600;
-	int minutes = total_seconds / 60;
-	int seconds = total_seconds % 60;
-
-	cout << "- maximum recursion depth | " << tracer.maximumDepth() << endl;
-	cout << "- elapsed time            | " << hours << ":" << minutes << ":" << seconds << endl;
 }
 
-//sort pairs indescending order
-bool compare(const std::pair<int, int>& a, const std::pair<int, int>& b)
+//seed of the random numbers of one worker, without "--seed" every run picks random seeds
+//"offset" (samples per pixel already rendered) keeps a resumed run from repeating the same samples
+unsigned int contextSeed(const RenderOptions& options, random_device& seeder, int rank, int worker, int offset)
 {
-	return a.first > b.first;
+	if (!options.hasSeed)
+		return seeder();
+
+	seed_seq sequence{ options.seed, (unsigned int)rank, (unsigned int)worker, (unsigned int)offset };
+	unsigned int seed;
+	sequence.generate(&seed, &seed + 1);
+	return seed;
 }
 
-//multi-process rendering
-void render_MPI(int argc, char* argv[])
+//continue from a checkpoint, returns the samples per pixel already rendered
+int resumeCheckpoint(const string& filename, Accumulator& buffer)
 {
-	//##################################################################
-	//							Preparation
-	//##################################################################
-	auto start = chrono::high_resolution_clock::now();
+	int width = buffer.getWidth();
+	int height = buffer.getHeight();
 
-	MPI_Init(&argc, &argv);
+	buffer.load(filename.c_str());
+	if (buffer.getWidth() != width || buffer.getHeight() != height)
+		throw runtime_error("checkpoint size does not match the image: " + filename);
 
-	int MPI_size;
-	int MPI_rank;
-	MPI_Comm_size(MPI_COMM_WORLD, &MPI_size);
-	MPI_Comm_rank(MPI_COMM_WORLD, &MPI_rank);
+	int done = buffer.getMinimumCount();
+	cout << "- resume checkpoint | " << done << " samples per pixel" << endl;
+	return done;
+}
 
+//add up checkpoints of independent runs (different seeds) and save the image, nothing is rendered
+void mergeCheckpoints(const RenderOptions& options)
+{
 	int width = SUPERSAMPLING ? (WIDTH * 3) : WIDTH;
 	int height = SUPERSAMPLING ? (HEIGHT * 3) : HEIGHT;
 
-	SceneParser sceneParser(inputFiles[CHOICE]);
-	//log some information
-	if (MPI_rank == 0)
+	try
+	{
+		Accumulator merged(width, height);
+		Accumulator buffer(width, height);
+		for (const string& filename : options.mergeFiles)
+		{
+			buffer.load(filename.c_str());
+			if (buffer.getWidth() != width || buffer.getHeight() != height)
+				throw runtime_error("checkpoint size does not match the image: " + filename);
+			merged.add(buffer);
+			cout << "- merge checkpoint | " << filename << endl;
+		}
+		cout << "- samples per pixel | " << merged.getMinimumCount() << endl;
+
+		if (!options.checkpointFile.empty())
+			merged.save(options.checkpointFile.c_str());
+
+		Image img(width, height);
+		merged.toImage(img);
+		saveResult(img);
+	}
+	catch (const runtime_error& e)
 	{
-		printRenderInforation(sceneParser);
+		cout << "- checkpoint error | " << e.what() << endl;
 	}
-	if (!sceneParser.checkStatus())
+}
+
+//single-process rendering, tiles are shared by a pool of threads
+//samples are accumulated in rounds, so a checkpoint can be saved after each round
+void render(const RenderOptions& options)
+{
+	if (!options.mergeFiles.empty())
 	{
-		MPI_Finalize();
+		mergeCheckpoints(options);
 		return;
 	}
+
+	auto start = chrono::high_resolution_clock::now();
+
+	//render size(not output size)
+	int width = SUPERSAMPLING ? (WIDTH * 3) : WIDTH;
+	int height = SUPERSAMPLING ? (HEIGHT * 3) : HEIGHT;
+
+	SceneParser sceneParser(inputFiles[CHOICE], options.numThreads);
+	ThreadPool pool(options.numThreads);
+	printRenderInforation(sceneParser, pool.size());
+	if (!sceneParser.checkStatus())
+		return;
 	//for static scene, no need to repeat computation
 	bool needRegenerateRay = sceneParser.hasStochasticCamera();
 	int sampleRate = sceneParser.hasStochasticScene() || needRegenerateRay || JITTER ? SAMPLERATE : 1;
-
+	
 	Camera* camera = sceneParser.getCamera();
 	camera->setSize(width, height);
 
-	//RayTracer tracer(&sceneParser, 0, 1.0);
-	MCTracer tracer(&sceneParser, 1.0);
+	Accumulator buffer(width, height);
+	int done = 0;
+	string checkpointFile = options.checkpointFile.empty() ? options.resumeFile : options.checkpointFile;
+	try
+	{
+		if (!options.resumeFile.empty())
+			done = resumeCheckpoint(options.resumeFile, buffer);
+	}
+	catch (const runtime_error& e)
+	{
+		cout << "- checkpoint error | " << e.what() << endl;
+		return;
+	}
 
-	MPI_Barrier(MPI_COMM_WORLD);
+	//the tracer is shared, every worker owns a context (random numbers, statistics)
+	MCTracer tracer(&sceneParser, options.stochasticFresnel, options.rayBudget, options.lightSamples);
+	random_device seeder;
+	vector<TraceContext*> contexts;
+	for (int t = 0; t < pool.size(); t++)
+		contexts.push_back(new TraceContext(contextSeed(options, seeder, 0, t, done)));
 
-	//##################################################################
-	//							Scheduling
-	//##################################################################
+	vector<Tile> tiles = generateTiles(width, height, options.tileSize, options.tileOrder);
+	int numTiles = tiles.size();
 
-	//what to do in rendering
-	vector<int> column2do;
+	//without checkpoints, all samples are rendered in one round
+	int interval = checkpointFile.empty() ? sampleRate : CHECKPOINTINTERVAL;
+	int numRounds = (max(sampleRate - done, 0) + interval - 1) / interval;
+	int numTasks = numTiles * numRounds;
+	int tenth = (numTasks + 9) / 10;
 
-	//only useful for process 0
-	vector<vector<int>> schedule;
+	atomic<int> finished(0);
+	mutex printLock;
 
-	if (sampleRate > 1)
+	while (done < sampleRate)
 	{
-		if (MPI_rank == 0)
-			cout << "- start process scheduling" << endl;
-
-		//each process do some measurements, then gather them together
-		double* measurement = new double[(width + MPI_size - 1) / MPI_size];
-		int blockSize = (width + MPI_size - 1) / MPI_size;
-		for (int i = 0; i < blockSize; i++)
-			measurement[i] = -1;
+		int samples = min(interval, sampleRate - done);
+		for (int t = 0; t < numTiles; t++)
+		{
+			pool.submit([&, t, samples](int worker)
+				{
+					accumulateTile(tiles[t], camera, tracer, *contexts[worker], samples, needRegenerateRay, buffer);
+
+					int count = ++finished;
+					if (count % tenth == 0 || count == numTasks)
+					{
+						lock_guard<mutex> guard(printLock);
+						cout << "render tile " << setw(5) << count << " / " << setw(5) << numTasks << endl;
+					}
+				});
+		}
+		pool.wait();
+		done += samples;
 
-		//estimate time consumption
-		for (int i = MPI_rank; i < width; i += MPI_size)
+		if (!checkpointFile.empty())
 		{
-			auto clock1 = chrono::high_resolution_clock::now();
-			for (int j = 0; j < height; j++)
+			try
 			{
-				Vector3f color;
-				Ray ray = camera->generateRay(i, j);
-				for (int k = 0; k < 3; k++)
-				{
-					if (JITTER)
-						ray = camera->generateJittoredRay(i, j);
-					else if (needRegenerateRay)
-						ray = camera->generateRay(i, j);
-
-					Hit hit;
-					Vector3f result = tracer.traceRay(ray, hit);
-					color = color + result;
-				}
-				//no need to store result
+				buffer.save(checkpointFile.c_str());
+				cout << "- save checkpoint | " << done << " / " << sampleRate << " samples per pixel" << endl;
+			}
+			catch (const runtime_error& e)
+			{
+				cout << "- checkpoint error | " << e.what() << endl;
 			}
-			auto clock2 = chrono::high_resolution_clock::now();
-			chrono::duration<double, milli> diff = clock2 - clock1;
-			measurement[i / MPI_size] = diff.count();
 		}
+	}
 
-		//gather measuerments and compute schedule
-		if (MPI_rank == 0)
+	Image img(width, height);
+	buffer.toImage(img);
+
+	int maximumDepth = 0;
+	long long numRays = 0;
+	for (auto context : contexts)
+	{
+		maximumDepth = max(maximumDepth, context->maxDepth);
+		numRays += context->numRays;
+		delete context;
+	}
+
+	saveResult(img);
+
+	auto end = chrono::high_resolution_clock::now();
+	chrono::duration<double> diff = end - start;
+
+	int total_seconds = static_cast<int>(diff.count());
+	int hours = total_seconds / 3600;
+	total_seconds %= 3600;
+	int minutes = total_seconds / 60;
+	int seconds = total_seconds % 60;
+
+	cout << "- maximum path depth      | " << maximumDepth << endl;
+	cout << "- rays per second         | " << (long long)(numRays / diff.count()) << endl;
+	cout << "- elapsed time            | " << hours << ":" << minutes << ":" << seconds << endl;
+}
+
+//message tags used by the tile scheduler of render_MPI
+enum MPI_tag { TAG_ASSIGN = 1, TAG_RESULT, TAG_PIXELS };
+
+//a result message is a header [wanted, tile ids...] followed by the pixels of those tiles,
+//"wanted" asks for that many new tiles, so the header doubles as a request
+//process 0 replies with a list of tile ids, an empty list means there is nothing left
+
+//describe where the pixels of some tiles live inside the image (one block per tile row),
+//so they can be received straight into the framebuffer
+MPI_Datatype tileLayout(const vector<Tile>& tiles, const int* ids, int count, int width)
+{
+	vector<int> lengths;
+	vector<int> displacements;
+	for (int k = 0; k < count; k++)
+	{
+		const Tile& tile = tiles[ids[k]];
+		for (int j = tile.y0; j < tile.y1; j++)
 		{
-			//gather measurements
-			vector<pair<double, int>> timePerColumn;
+			lengths.push_back(tile.getWidth() * 3);
+			displacements.push_back((j * width + tile.x0) * 3);
+		}
+	}
+
+	MPI_Datatype layout;
+	MPI_Type_indexed(lengths.size(), lengths.data(), displacements.data(), MPI_FLOAT, &layout);
+	MPI_Type_commit(&layout);
+	return layout;
+}
 
-			//measurements of process 0
-			for (int i = 0; i < blockSize; i++)
+//process 0: hand out tiles on demand and collect results, its own threads render tiles as well
+//only the main thread calls MPI
+void scheduleTiles(const vector<Tile>& tiles, atomic<int>& nextTile, int MPI_size, Image& img)
+{
+	int numTiles = tiles.size();
+	int activeWorkers = MPI_size - 1;	//workers that may still ask for tiles
+	int assigned = 0;					//tiles given to other processes
+	int received = 0;					//results received from other processes
+
+	float* framebuffer = reinterpret_cast<float*>(img.GetData());
+	vector<int> header;
+	vector<int> reply;
+	MPI_Status status;
+
+	while (activeWorkers > 0 || received < assigned)
+	{
+		int flag;
+		MPI_Iprobe(MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &flag, &status);
+		if (!flag)
+		{
+			//don't steal a core from the rendering threads
+			this_thread::sleep_for(chrono::microseconds(50));
+			continue;
+		}
+
+		int source = status.MPI_SOURCE;
+		int size;
+		MPI_Get_count(&status, MPI_INT, &size);
+		header.resize(size);
+		MPI_Recv(header.data(), size, MPI_INT, source, TAG_RESULT, MPI_COMM_WORLD, &status);
+
+		//pixels follow the header from the same source, so they arrive in order
+		int count = size - 1;
+		if (count > 0)
+		{
+			MPI_Datatype layout = tileLayout(tiles, header.data() + 1, count, img.Width());
+			MPI_Recv(framebuffer, 1, layout, source, TAG_PIXELS, MPI_COMM_WORLD, &status);
+			MPI_Type_free(&layout);
+			received += count;
+		}
+
+		int wanted = header[0];
+		if (wanted > 0)
+		{
+			//share the same counter with local threads
+			reply.clear();
+			while ((int)reply.size() < wanted)
 			{
-				if (measurement[i] == -1)
+				int tileIndex = nextTile++;
+				if (tileIndex >= numTiles)
 					break;
-				else
-					timePerColumn.push_back(make_pair(measurement[i], i * MPI_size));
+				reply.push_back(tileIndex);
 			}
 
-			//measurements from other processes
-			MPI_Status status;
-			for (int source = 1; source < MPI_size; source++)
+			if (reply.empty())
+				activeWorkers--;
+			assigned += reply.size();
+
+			MPI_Send(reply.data(), reply.size(), MPI_INT, source, TAG_ASSIGN, MPI_COMM_WORLD);
+		}
+	}
+}
+
+//other processes: keep asking process 0 for tiles until there is nothing left
+//a few tiles are kept in flight, so threads never wait for the network,
+//finished tiles are sent back in batches without blocking
+void requestTiles(const vector<Tile>& tiles, ThreadPool& pool, const function<void(int, int, float*)>& render)
+{
+	//one batch of finished tiles on its way to process 0
+	struct Package
+	{
+		vector<int> header;
+		vector<float> pixels;
+		MPI_Request requests[2];
+	};
+
+	mutex finishedLock;
+	condition_variable finishedSignal;
+	vector<int> finished;				//written by threads
+	vector<vector<float>> buffers(tiles.size());
+
+	vector<int> ready;					//finished tiles not sent yet
+	vector<Package*> packages;			//sent but maybe not delivered yet
+	int inFlight = 2 * pool.size();
+	int outstanding = 0;				//tiles received but not sent back
+	bool noMoreTiles = false;
+
+	vector<int> assignment(inFlight);
+	MPI_Request assignRequest;
+	bool assignPending = false;
+	MPI_Status status;
+
+	while (true)
+	{
+		//new tiles from process 0
+		if (assignPending)
+		{
+			int done;
+			if (outstanding == 0)
+			{
+				MPI_Wait(&assignRequest, &status);
+				done = 1;
+			}
+			else
+				MPI_Test(&assignRequest, &done, &status);
+
+			if (done)
 			{
-				MPI_Recv(measurement, blockSize, MPI_DOUBLE, source, 0, MPI_COMM_WORLD, &status);
-				for (int i = 0; i < blockSize; i++)
+				assignPending = false;
+				int count;
+				MPI_Get_count(&status, MPI_INT, &count);
+				if (count == 0)
+					noMoreTiles = true;
+
+				for (int k = 0; k < count; k++)
 				{
-					if (measurement[i] == -1)
-						break;
-					else
-						timePerColumn.push_back(make_pair(measurement[i], i * MPI_size + source));
+					int tileIndex = assignment[k];
+					buffers[tileIndex].resize(tiles[tileIndex].getNumPixels() * 3);
+					outstanding++;
+					pool.submit([&, tileIndex](int worker)
+						{
+							render(tileIndex, worker, buffers[tileIndex].data());
+
+							lock_guard<mutex> guard(finishedLock);
+							finished.push_back(tileIndex);
+							finishedSignal.notify_one();
+						});
 				}
 			}
+		}
 
-			//start scheduling
-			vector<double> sums;
-			for (int i = 0; i < MPI_size; i++)
+		if (noMoreTiles && outstanding == 0)
+			break;
+
+		//finished tiles from threads
+		{
+			unique_lock<mutex> guard(finishedLock);
+			if (finished.empty() && outstanding > (int)ready.size())
 			{
-				vector<int> V;
-				schedule.push_back(V);
-				sums.push_back(0);
+				//wake up now and then to check for new tiles
+				finishedSignal.wait_for(guard, chrono::microseconds(200));
 			}
+			ready.insert(ready.end(), finished.begin(), finished.end());
+			finished.clear();
+		}
 
-			//sort in descending order
-			sort(timePerColumn.begin(), timePerColumn.end(), compare);
+		//send a batch when it is full, when threads run low on work, or when nothing else will finish
+		int inPool = outstanding - ready.size();
+		int wanted = (noMoreTiles || assignPending) ? 0 : inFlight - inPool;
+		bool sendNow = (int)ready.size() >= TILESPERMESSAGE || wanted >= pool.size() || (inPool == 0 && !ready.empty());
+		if (sendNow)
+		{
+			Package* package = new Package();
+			package->header.push_back(wanted);
+			for (int tileIndex : ready)
+			{
+				package->header.push_back(tileIndex);
+				package->pixels.insert(package->pixels.end(), buffers[tileIndex].begin(), buffers[tileIndex].end());
+				vector<float>().swap(buffers[tileIndex]);
+			}
+			outstanding -= ready.size();
+			ready.clear();
 
-			for (int i = 0; i < width; i++)
+			//the reply is posted before the request, so it never needs a bounce buffer
+			if (wanted > 0)
 			{
-				//choose most vacant process
-				int process = distance(sums.begin(), min_element(sums.begin(), sums.end()));
-				//casher's algorithm
-				schedule[process].push_back(timePerColumn[i].second);
-				sums[process] += timePerColumn[i].first;
+				MPI_Irecv(assignment.data(), inFlight, MPI_INT, 0, TAG_ASSIGN, MPI_COMM_WORLD, &assignRequest);
+				assignPending = true;
 			}
 
-			//schedule for process 0 itself
-			for (auto column : schedule[0])
-				column2do.push_back(column);
+			MPI_Isend(package->header.data(), package->header.size(), MPI_INT, 0, TAG_RESULT, MPI_COMM_WORLD, &package->requests[0]);
+			package->requests[1] = MPI_REQUEST_NULL;
+			if (!package->pixels.empty())
+				MPI_Isend(package->pixels.data(), package->pixels.size(), MPI_FLOAT, 0, TAG_PIXELS, MPI_COMM_WORLD, &package->requests[1]);
+			packages.push_back(package);
+		}
 
-			int* package = new int[width]; //"width" is the upper bound of package size
-			for (int target = 1; target < MPI_size; target++)
+		//release delivered packages
+		for (auto it = packages.begin(); it != packages.end();)
+		{
+			int delivered;
+			MPI_Testall(2, (*it)->requests, &delivered, MPI_STATUSES_IGNORE);
+			if (delivered)
 			{
-				//make a package for each process
-				int workSize = schedule[target].size();
-				for (int j = 0; j < width; j++)
-				{
-					if (j < workSize)
-						package[j] = schedule[target][j];
-					else
-						package[j] = -1;
-				}
-				MPI_Send(package, width, MPI_INT, target, 0, MPI_COMM_WORLD);
+				delete *it;
+				it = packages.erase(it);
 			}
-
-			delete[] package;
+			else
+				it++;
 		}
-		else
+	}
+
+	for (auto package : packages)
+	{
+		MPI_Waitall(2, package->requests, MPI_STATUSES_IGNORE);
+		delete package;
+	}
+}
+
+//sample-parallel: every process renders the whole image with its own random numbers,
+//the buffers of all processes are added up on process 0 every REDUCEINTERVAL samples per pixel
+//scaling does not depend on resolution, and process 0 saves a progressively better image after each reduction
+//the time process 0 spends saving is added to "saving"
+void renderSamples(const vector<Tile>& tiles, ThreadPool& pool, const function<void(int, int, int, Accumulator&)>& render,
+	Accumulator& local, int done, int sampleRate, const string& checkpointFile, int MPI_rank, int MPI_size,
+	chrono::duration<double>& saving)
+{
+	int width = local.getWidth();
+	int height = local.getHeight();
+
+	//samples per pixel of this process, the remainder goes to the first processes
+	int remaining = max(sampleRate - done, 0);
+	int localSamples = remaining / MPI_size + (MPI_rank < remaining % MPI_size ? 1 : 0);
+	int maxSamples = (remaining + MPI_size - 1) / MPI_size;
+	int numRounds = (maxSamples + REDUCEINTERVAL - 1) / REDUCEINTERVAL;
+
+	Accumulator global(MPI_rank == 0 ? width : 0, MPI_rank == 0 ? height : 0);
+	Image img(MPI_rank == 0 ? width : 0, MPI_rank == 0 ? height : 0);
+
+	int numTiles = tiles.size();
+	int rendered = 0;
+	for (int round = 0; round < numRounds; round++)
+	{
+		int samples = min(REDUCEINTERVAL, localSamples - rendered);
+		if (samples > 0)
 		{
-			MPI_Send(measurement, blockSize, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+			for (int t = 0; t < numTiles; t++)
+				pool.submit([&, t, samples](int worker) { render(t, worker, samples, local); });
+			pool.wait();
+			rendered += samples;
+		}
 
-			//receive assignments from process 0
-			MPI_Status status;
-			int* package = new int[width];
-			MPI_Recv(package, width, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
+		//every process takes part in every reduction, even when it has nothing new
+		MPI_Reduce(local.getSums(), global.getSums(), local.getNumPixels() * 3, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+		MPI_Reduce(local.getCounts(), global.getCounts(), local.getNumPixels(), MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
 
-			for (int i = 0; i < width; i++)
+		if (MPI_rank == 0)
+		{
+			cout << "- samples per pixel | " << global.getMinimumCount() << " / " << sampleRate << endl;
+			auto saveStart = chrono::high_resolution_clock::now();
+			if (!checkpointFile.empty())
 			{
-				if (package[i] == -1)
-					break;
-				else
-					column2do.push_back(package[i]);
+				try
+				{
+					global.save(checkpointFile.c_str());
+				}
+				catch (const runtime_error& e)
+				{
+					cout << "- checkpoint error | " << e.what() << endl;
+				}
 			}
-
-			delete[] package;
+			global.toImage(img);
+			saveResult(img);
+			saving += chrono::high_resolution_clock::now() - saveStart;
 		}
+	}
+}
+
+//a scene rebuilt in place from a buffer that is stored once per node (MPI shared memory window)
+struct SharedScene
+{
+	unique_ptr<SceneParser> parser;
 
-		delete[] measurement;
+	MPI_Win window = MPI_WIN_NULL;
+	MPI_Comm nodeComm = MPI_COMM_NULL;		//processes on the same node
+	MPI_Comm leaderComm = MPI_COMM_NULL;	//first process of every node
 
-		if (MPI_rank == 0)
+	//collective, must be called by every process before MPI_Finalize
+	void release()
+	{
+		//the scene points into the window, so it goes first
+		parser.reset();
+		if (window != MPI_WIN_NULL)
+			MPI_Win_free(&window);
+		if (leaderComm != MPI_COMM_NULL)
+			MPI_Comm_free(&leaderComm);
+		if (nodeComm != MPI_COMM_NULL)
+			MPI_Comm_free(&nodeComm);
+	}
+};
+
+//process 0 parses the scene (meshes, normals, BVH, textures) and serializes it as one flat buffer,
+//the buffer is broadcast to one process per node and placed in memory shared by the whole node,
+//then every process rebuilds the scene on top of it, so large arrays exist once per node instead of once per process
+//hierarchies are built with "numThreads" threads
+void shareScene(int MPI_rank, SharedScene& scene, int numThreads)
+{
+	vector<char> buffer;
+	if (MPI_rank == 0)
+	{
+		scene.parser.reset(new SceneParser(inputFiles[CHOICE], numThreads));
+		//an empty buffer tells other processes that parsing failed
+		if (scene.parser->checkStatus())
 		{
-			cout << "- finish process scheduling" << endl;
+			ByteWriter writer;
+			scene.parser->serialize(writer);
+			buffer.swap(writer.getBuffer());
 		}
-		MPI_Barrier(MPI_COMM_WORLD);
 	}
-	else
+
+	long long size = buffer.size();
+	MPI_Bcast(&size, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+	if (size == 0)
 	{
-		for (int column = MPI_rank; column < width; column += MPI_size)
-			column2do.push_back(column);
+		if (MPI_rank != 0)
+		{
+			ByteReader empty(NULL, 0);
+			scene.parser.reset(new SceneParser(empty));
+		}
+		return;
+	}
 
+	int nodeRank;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, MPI_rank, MPI_INFO_NULL, &scene.nodeComm);
+	MPI_Comm_rank(scene.nodeComm, &nodeRank);
+	MPI_Comm_split(MPI_COMM_WORLD, nodeRank == 0 ? 0 : MPI_UNDEFINED, MPI_rank, &scene.leaderComm);
+
+	//only the first process of a node allocates, the others map its memory
+	char* data;
+	MPI_Aint windowSize;
+	int unit;
+	MPI_Win_allocate_shared(nodeRank == 0 ? size + SERIALIZER_ALIGNMENT : 0, 1, MPI_INFO_NULL, scene.nodeComm, &data, &scene.window);
+	MPI_Win_shared_query(scene.window, 0, &windowSize, &unit, &data);
+
+	//arrays are used in place, so the buffer starts at an aligned address
+	//(the window is mapped page by page, so this is the same offset in every process)
+	data += (SERIALIZER_ALIGNMENT - (size_t)data % SERIALIZER_ALIGNMENT) % SERIALIZER_ALIGNMENT;
+
+	MPI_Win_fence(0, scene.window);
+	if (nodeRank == 0)
+	{
 		if (MPI_rank == 0)
 		{
-			for (int process = 0; process < MPI_size; process++)
-			{
-				vector<int> work;
-				for (int column = process; column < width; column += MPI_size)
-					work.push_back(column);
-
-				schedule.push_back(work);
-			}
+			memcpy(data, buffer.data(), size);
+			vector<char>().swap(buffer);
 		}
+
+		//MPI counts are int, so large scenes are sent in pieces
+		const long long piece = 1 << 30;
+		for (long long offset = 0; offset < size; offset += piece)
+			MPI_Bcast(data + offset, (int)min(piece, size - offset), MPI_CHAR, 0, scene.leaderComm);
+	}
+	MPI_Win_fence(0, scene.window);
+
+	if (MPI_rank == 0)
+	{
+		int numNodes;
+		MPI_Comm_size(scene.leaderComm, &numNodes);
+		cout << "- scene broadcast | " << fixed << setprecision(2) << size / 1048576.0 << " MB, shared by "
+			<< numNodes << " node(s)" << endl;
 	}
 
+	//process 0 also drops its parsed copy and uses the shared one
+	scene.parser.reset();
+	ByteReader reader(data, size, true);
+	reader.setBuildThreads(numThreads);
+	scene.parser.reset(new SceneParser(reader));
+}
+
+//multi-process rendering, every process runs a pool of threads (hybrid MPI + threads)
+//the scene is parsed once by process 0 and broadcast, it is stored once per node and shared by its processes
+//tiles are handed out dynamically by process 0, so fast processes simply render more tiles
+//or, with "--sample-parallel", every process renders the whole image with its own samples
+void render_MPI(int argc, char* argv[])
+{
 	//##################################################################
-	//							Computation
+	//							Preparation
 	//##################################################################
-	
-	//store RBG values
-	float* data = new float[column2do.size() * height * 3];
+	auto start = chrono::high_resolution_clock::now();
+
+	//only the main thread talks to MPI, worker threads just render
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+
+	int MPI_size;
+	int MPI_rank;
+	MPI_Comm_size(MPI_COMM_WORLD, &MPI_size);
+	MPI_Comm_rank(MPI_COMM_WORLD, &MPI_rank);
 
-	int tenth = (column2do.size() + 9) / 10;
+	if (MPI_rank == 0 && provided < MPI_THREAD_FUNNELED)
+		cout << "Warning: MPI library does not support MPI_THREAD_FUNNELED" << endl;
 
-	for (int i = 0; i < column2do.size(); i++)
+	RenderOptions options = parseOptions(argc, argv);
+	if (!options.mergeFiles.empty())
 	{
-		if (i % tenth == 0)
+		if (MPI_rank == 0)
+			mergeCheckpoints(options);
+		MPI_Finalize();
+		return;
+	}
+
+	int width = SUPERSAMPLING ? (WIDTH * 3) : WIDTH;
+	int height = SUPERSAMPLING ? (HEIGHT * 3) : HEIGHT;
+
+	SharedScene scene;
+	shareScene(MPI_rank, scene, options.numThreads);
+	const SceneParser& sceneParser = *scene.parser;
+	ThreadPool pool(options.numThreads);
+	//log some information
+	if (MPI_rank == 0)
+	{
+		printRenderInforation(sceneParser, pool.size(), MPI_size);
+	}
+	//stop everywhere if any process failed to rebuild the scene
+	int sceneOK = sceneParser.checkStatus() ? 1 : 0;
+	int allSceneOK;
+	MPI_Allreduce(&sceneOK, &allSceneOK, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+	if (!allSceneOK)
+	{
+		if (!sceneOK && MPI_rank != 0)
+			cout << "- process " << MPI_rank << " | " << sceneParser.getErrorMessage() << endl;
+		scene.release();
+		MPI_Finalize();
+		return;
+	}
+	//for static scene, no need to repeat computation
+	bool needRegenerateRay = sceneParser.hasStochasticCamera();
+	int sampleRate = sceneParser.hasStochasticScene() || needRegenerateRay || JITTER ? SAMPLERATE : 1;
+
+	Camera* camera = sceneParser.getCamera();
+	camera->setSize(width, height);
+
+	//only sample-parallel rendering accumulates samples, process 0 reads and writes the checkpoints
+	Accumulator buffer(options.sampleParallel ? width : 0, options.sampleParallel ? height : 0);
+	int done = 0;
+	string checkpointFile = options.checkpointFile.empty() ? options.resumeFile : options.checkpointFile;
+	if (!options.sampleParallel && !checkpointFile.empty() && MPI_rank == 0)
+		cout << "Warning: checkpoints need \"--sample-parallel\" with MPI, ignore them" << endl;
+	if (options.sampleParallel && !options.resumeFile.empty() && MPI_rank == 0)
+	{
+		try
 		{
-			cout << "Process " << setw(2) << MPI_rank << " render column " << setw(4) << i << " / " << setw(4) << column2do.size() << endl;
+			done = resumeCheckpoint(options.resumeFile, buffer);
 		}
-
-		for (int j = 0; j < height; j++)
+		catch (const runtime_error& e)
 		{
-			Vector3f color;
-			Ray ray = camera->generateRay(column2do[i], j);
-			for (int k = 0; k < sampleRate; k++)
-			{
-				//Generate ray
-				if (JITTER)
-					ray = camera->generateJittoredRay(column2do[i], j);
-				else if (needRegenerateRay)
-					ray = camera->generateRay(column2do[i], j);
-
-				Hit hit;
-				Vector3f result = tracer.traceRay(ray, hit);
-				if (isnan(result[0]))
-					continue;
-				color = color + result;
-			}
-			color = color / sampleRate;
-
-			data[i * height * 3 + j * 3] = color[0];
-			data[i * height * 3 + j * 3 + 1] = color[1];
-			data[i * height * 3 + j * 3 + 2] = color[2];
+			cout << "- checkpoint error | " << e.what() << endl;
+			done = -1;
 		}
 	}
-
-	//merge into a whole picture
-	MPI_Status recv_status;
-	if (MPI_rank == 0)
+	MPI_Bcast(&done, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if (done < 0)
 	{
-		Image img(width, height);
-		//piece rendered by process 0
-		for (int i = 0; i < column2do.size(); i++)
+		scene.release();
+		MPI_Finalize();
+		return;
+	}
+
+	//RayTracer tracer(&sceneParser, 0, 1.0);
+	MCTracer tracer(&sceneParser, options.stochasticFresnel, options.rayBudget, options.lightSamples);
+	random_device seeder;
+	vector<TraceContext*> contexts;
+	for (int t = 0; t < pool.size(); t++)
+		contexts.push_back(new TraceContext(contextSeed(options, seeder, MPI_rank, t, done)));
+
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	//##################################################################
+	//					Computation & Scheduling
+	//##################################################################
+
+	vector<Tile> tiles = generateTiles(width, height, options.tileSize, options.tileOrder);
+	int numTiles = tiles.size();
+
+	//every process reports its own progress, about ten times when the work is balanced
+	//(a process does not know in advance how many tiles it will get)
+	atomic<int> finished(0);
+	mutex printLock;
+	int tenth = max(numTiles / (10 * MPI_size), 1);
+	auto reportTile = [&]()
 		{
-			for (int j = 0; j < height; j++)
+			int count = ++finished;
+			if (count % tenth == 0)
 			{
-				img.SetPixel(column2do[i], j, Vector3f(data[i * height * 3 + j * 3], data[i * height * 3 + j * 3 + 1], data[i * height * 3 + j * 3 + 2]));
+				lock_guard<mutex> guard(printLock);
+				cout << "Process " << setw(2) << MPI_rank << " render tile " << setw(5) << count << " / " << setw(5) << numTiles << endl;
 			}
-		}
+		};
 
-		//gather image pieces from other processes
-		MPI_Status recv_status;
-		float* package = new float[height * 3];
-		for (int source = 1; source < MPI_size; source++)
+	auto renderTileTask = [&](int tileIndex, int worker, float* pixels)
 		{
-			//transfer one column at a time
-			for (int i = 0; i < schedule[source].size(); i++)
+			renderTile(tiles[tileIndex], camera, tracer, *contexts[worker], sampleRate, needRegenerateRay, pixels);
+			reportTile();
+		};
+
+	//time process 0 spends writing images and checkpoints, it is not part of the render time
+	chrono::duration<double> saving(0);
+
+	if (options.sampleParallel)
+	{
+		if (MPI_rank == 0)
+			cout << "- start rendering " << sampleRate << " samples per pixel in parallel" << endl;
+
+		auto accumulateTileTask = [&](int tileIndex, int worker, int samples, Accumulator& buffer)
 			{
-				MPI_Recv(package, height * 3, MPI_FLOAT, source, i, MPI_COMM_WORLD, &recv_status);
+				accumulateTile(tiles[tileIndex], camera, tracer, *contexts[worker], samples, needRegenerateRay, buffer);
+			};
+		renderSamples(tiles, pool, accumulateTileTask, buffer, done, sampleRate, checkpointFile, MPI_rank, MPI_size, saving);
+	}
+	else if (MPI_rank == 0)
+	{
+		cout << "- start rendering " << numTiles << " tiles" << endl;
 
-				for (int j = 0; j < height; j++)
-				{
-					img.SetPixel(schedule[source][i], j, Vector3f(package[j * 3], package[j * 3 + 1], package[j * 3 + 2]));
-				}
-			}
-		}
-		delete[] package;
+		Image img(width, height);
 
-		if (GAUSSIANBLUR)
+		//local threads take tiles from the same counter as other processes
+		atomic<int> nextTile(0);
+		for (int t = 0; t < pool.size(); t++)
 		{
-			cout << "- start Gaussian blurring" << endl;
-			img.GaussianBlur();
+			pool.submit([&](int worker)
+				{
+					int tileIndex;
+					while ((tileIndex = nextTile++) < numTiles)
+					{
+						renderTile(tiles[tileIndex], camera, tracer, *contexts[worker], sampleRate, needRegenerateRay, img);
+						reportTile();
+					}
+				});
 		}
 
-		if (SUPERSAMPLING)
-		{
-			Image small_img(WIDTH, HEIGHT);
-			cout << "- start down sampling" << endl;
-			small_img.DownSampling(img);
-			small_img.SaveImage(getOutputFilePath(outputFiles[CHOICE]).c_str());
-		}
-		else
-			img.SaveImage(getOutputFilePath(outputFiles[CHOICE]).c_str());
-		
+		scheduleTiles(tiles, nextTile, MPI_size, img);
+		pool.wait();
+
+		auto saveStart = chrono::high_resolution_clock::now();
+		saveResult(img);
+		saving += chrono::high_resolution_clock::now() - saveStart;
 	}
 	else
 	{
-		//send result to process one at a time
-		for (int i = 0; i < column2do.size(); i++)
-		{
-			MPI_Send(&(data[i * height * 3]), height * 3, MPI_FLOAT, 0, i, MPI_COMM_WORLD);
-		}
+		requestTiles(tiles, pool, renderTileTask);
 	}
 
-	delete[] data;
+	//time between the first and the last process running out of work
+	chrono::duration<double> busy = chrono::high_resolution_clock::now() - start - saving;
+	double finishTime = busy.count();
+	double earliest, latest;
+	MPI_Reduce(&finishTime, &earliest, 1, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&finishTime, &latest, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
 
+	int localDepth = 0;
+	for (auto context : contexts)
+	{
+		localDepth = max(localDepth, context->maxDepth);
+		delete context;
+	}
+	int maximumDepth;
+	MPI_Reduce(&localDepth, &maximumDepth, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+
+	scene.release();
 	MPI_Finalize();
 
 	auto end = chrono::high_resolution_clock::now();
-	chrono::duration<double> diff = end - start;
+	chrono::duration<double> diff = end - start - saving;
 
 	// Only process 0 prints the elapsed time
 	if (MPI_rank == 0)
@@ -452,7 +913,8 @@ void render_MPI(int argc, char* argv[])
 		int minutes = total_seconds / 60;
 		int seconds = total_seconds % 60;
 
-		cout << "- maximum trace depth | " << tracer.maximumDepth() << endl;
+		cout << "- maximum trace depth | " << maximumDepth << endl;
+		cout << "- idle tail           | " << fixed << setprecision(3) << latest - earliest << "s" << endl;
 		cout << "- elapsed time        | " << hours << ":" << minutes << ":" << seconds << endl;
 	}
-}
+}
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <cstdlib>
 #include <cmath>
 #include <iostream>
+#include <memory>
 
 #include "SceneParser.hpp"
 
@@ -15,9 +16,9 @@ using namespace std;
 #define M_PI 3.14159265358979
 #define DegreesToRadians(x) ((M_PI * x) / 180.0f)
 
-SceneParser::SceneParser(const char* filename) 
+//initialize some reasonable default values
+void SceneParser::initialize()
 {
-    //initialize some reasonable default values
     file = NULL;
 
     camera = NULL;
@@ -39,6 +40,12 @@ SceneParser::SceneParser(const char* filename)
 
     stochastic = false;
     stochasticCamera = false;
+}
+
+SceneParser::SceneParser(const char* filename, int threads) 
+{
+    initialize();
+    numThreads = threads;
 
     //parse the file
     try
@@ -86,7 +93,8 @@ SceneParser::~SceneParser()
         delete lightGroup;
     if (camera != NULL)
         delete camera;
-    if (numMaterials > 0)
+    //a scene buffer with an error may leave an array with fewer elements than it has room for
+    if (materials != NULL)
     {
         for (int i = 0; i < numMaterials; i++)
         {
@@ -94,7 +102,7 @@ SceneParser::~SceneParser()
         }
         delete[] materials;
     }
-    if (numLights > 0)
+    if (lights != NULL)
     {
         for (int i = 0; i < numLights; i++)
         {
@@ -105,6 +113,201 @@ SceneParser::~SceneParser()
 }
 // ====================================================================
 // ====================================================================
+//every serialized scene starts with this
+static const char SCENE_MAGIC[4] = { 'S', 'C', 'N', '1' };
+
+Object3D* readObject(ByteReader& reader)
+{
+    int type = reader.read<int>();
+    switch (type)
+    {
+    case GROUP:
+        return new Group(reader);
+    case SPHERE:
+        return new Sphere(reader);
+    case PLANE:
+        return new Plane(reader);
+    case TRIANGLE:
+        return new Triangle(reader);
+    case MESH:
+        return new Mesh(reader);
+    case TRANSFORM:
+        return new Transform(reader);
+    case VELOCITY:
+        return new Velocity(reader);
+    default:
+        throw runtime_error("unknown object type in scene buffer");
+    }
+}
+
+static LightObject* readLightObject(ByteReader& reader)
+{
+    int type = reader.read<int>();
+    if (type == LIGHTGROUP)
+    {
+        //owned until it is complete, so an error deletes it with the light objects read so far
+        unique_ptr<LightGroup> answer(new LightGroup());
+        int size = reader.read<int>();
+        for (int i = 0; i < size; i++)
+            answer->addLightObject(readLightObject(reader));
+        answer->buildHierarchy(reader.getBuildThreads());
+        return answer.release();
+    }
+    else if (type == LIGHTTRIANGLE)
+    {
+        Vector3f vertices[3];
+        reader.readArray(vertices, 3);
+        Vector3f color = reader.read<Vector3f>();
+        float falloff = reader.read<float>();
+        int id = reader.read<int>();
+        return new LightTriangle(vertices[0], vertices[1], vertices[2], color, falloff, id);
+    }
+    else if (type == LIGHTSPHERE)
+    {
+        Vector3f center = reader.read<Vector3f>();
+        Vector3f color = reader.read<Vector3f>();
+        float radius = reader.read<float>();
+        float falloff = reader.read<float>();
+        int id = reader.read<int>();
+        return new LightSphere(center, color, radius, falloff, id);
+    }
+    throw runtime_error("unknown light object type in scene buffer");
+}
+
+static Light* readLight(ByteReader& reader)
+{
+    int type = reader.read<int>();
+    if (type == DIRECTIONAL)
+    {
+        Vector3f direction = reader.read<Vector3f>();
+        Vector3f color = reader.read<Vector3f>();
+        return new DirectionalLight(direction, color);
+    }
+    else if (type == POINT)
+    {
+        Vector3f position = reader.read<Vector3f>();
+        Vector3f color = reader.read<Vector3f>();
+        float falloff = reader.read<float>();
+        return new PointLight(position, color, falloff);
+    }
+    throw runtime_error("unknown light type in scene buffer");
+}
+
+static Camera* readCamera(ByteReader& reader)
+{
+    int type = reader.read<int>();
+    Vector3f center = reader.read<Vector3f>();
+    Vector3f direction = reader.read<Vector3f>();
+    Vector3f up = reader.read<Vector3f>();
+    float angle = reader.read<float>();
+    if (type == PERSPECTIVE)
+    {
+        return new PerspectiveCamera(center, direction, up, angle);
+    }
+    else if (type == DOF)
+    {
+        float focalLength = reader.read<float>();
+        float aperture = reader.read<float>();
+        return new DOFCamera(center, direction, up, angle, focalLength, aperture);
+    }
+    throw runtime_error("unknown camera type in scene buffer");
+}
+
+void SceneParser::serialize(ByteWriter& writer) const
+{
+    writer.writeArray(SCENE_MAGIC, 4);
+
+    writer.write(backgroundColor);
+    writer.write(ambientLight);
+    writer.write(stochastic);
+    writer.write(stochasticCamera);
+    writer.write(numObjects);
+    writer.write(numLightObjects);
+
+    camera->serialize(writer);
+
+    writer.write(numLights);
+    for (int i = 0; i < numLights; i++)
+        lights[i]->serialize(writer);
+
+    writer.write(numMaterials);
+    for (int i = 0; i < numMaterials; i++)
+        materials[i]->serialize(writer);
+    writer.setMaterials(materials, numMaterials);
+
+    group->serialize(writer);
+    lightGroup->serialize(writer);
+}
+
+SceneParser::SceneParser(ByteReader& reader)
+{
+    initialize();
+    numThreads = reader.getBuildThreads();
+
+    try
+    {
+        char magic[4];
+        reader.readArray(magic, 4);
+        if (memcmp(magic, SCENE_MAGIC, 4))
+            throw runtime_error("not a scene buffer");
+
+        backgroundColor = reader.read<Vector3f>();
+        ambientLight = reader.read<Vector3f>();
+        stochastic = reader.read<bool>();
+        stochasticCamera = reader.read<bool>();
+        numObjects = reader.read<int>();
+        numLightObjects = reader.read<int>();
+
+        camera = readCamera(reader);
+
+        //counts are set after each array is complete, so the destructor never sees a half-filled array
+        int count = reader.read<int>();
+        if (count > 0)
+        {
+            lights = new Light * [count];
+            for (int i = 0; i < count; i++)
+            {
+                lights[i] = readLight(reader);
+                numLights = i + 1;
+            }
+        }
+
+        count = reader.read<int>();
+        if (count > 0)
+        {
+            materials = new Material * [count];
+            for (int i = 0; i < count; i++)
+            {
+                materials[i] = Material::deserialize(reader);
+                numMaterials = i + 1;
+            }
+        }
+        reader.setMaterials(materials, numMaterials);
+
+        Object3D* object = readObject(reader);
+        group = dynamic_cast<Group*>(object);
+        if (group == NULL)
+        {
+            delete object;
+            throw runtime_error("scene buffer does not start with a group");
+        }
+
+        LightObject* lightObject = readLightObject(reader);
+        lightGroup = dynamic_cast<LightGroup*>(lightObject);
+        if (lightGroup == NULL)
+        {
+            delete lightObject;
+            throw runtime_error("scene buffer does not contain a light group");
+        }
+    }
+    catch (const runtime_error& e)
+    {
+        everythingOK = false;
+        errorMessage = e.what();
+    }
+}
+// ====================================================================
+// ====================================================================
 void SceneParser::parseFile() 
 {
     char token[MAX_PARSER_TOKEN_LENGTH];
@@ -343,6 +546,7 @@ LightGroup* SceneParser::parseLightGroup()
     }
     getToken(token); matchToken(token, "}");
 
+    answer->buildHierarchy(numThreads);
     // return the group
     return answer;
 }
@@ -757,6 +961,7 @@ Group* SceneParser::parseGroup()
     }
     getToken(token); matchToken(token, "}");
 
+    answer->buildHierarchy(numThreads);
     return answer;
 }
 Sphere* SceneParser::parseSphere()
@@ -824,7 +1029,7 @@ Mesh* SceneParser::parseTriangleMesh()
     if (meshPath == "<file does not exist>")
         throw runtime_error("cannot find mesh file " + string(filename));
 
-    Mesh* answer = new Mesh(meshPath.c_str(), currentMaterial);
+    Mesh* answer = new Mesh(meshPath.c_str(), currentMaterial, numThreads);
 
     return answer;
 }
@@ -26,9 +26,19 @@
 class SceneParser
 {
 public:
-    SceneParser(const char* filename);
+    //hierarchies (BVH) are built with "numThreads" threads, 0 = all hardware threads
+    SceneParser(const char* filename, int numThreads = 0);
+
+    //rebuild a scene written by "serialize", nothing is read from disk
+    //a borrowing reader leaves large arrays (vertices, BVH indices, textures) in its buffer, which must outlive the scene
+    //hierarchies that are rebuilt use the reader's build threads (see "ByteReader::setBuildThreads")
+    explicit SceneParser(ByteReader& reader);
+
     ~SceneParser();
 
+    //camera, lights, materials (with textures), objects (with meshes and their BVH)
+    void serialize(ByteWriter& writer) const;
+
     Camera* getCamera() const
     {
         return camera;
@@ -108,6 +118,8 @@ public:
     }
 
 private:
+    void initialize();
+
     void parseFile();
 
     void parsePerspectiveCamera();
@@ -167,6 +179,9 @@ private:
     string errorMessage;
     bool everythingOK;
 
+    //threads for building hierarchies
+    int numThreads;
+
     bool stochastic;
     bool stochasticCamera;
 };
\ No newline at end of file
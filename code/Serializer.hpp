@@ -0,0 +1,196 @@
+//flat byte buffers for sending a parsed scene to other processes
+//values are copied byte by byte, so both sides must run the same binary (same platform)
+#pragma once
+#include <vector>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include "SharedArray.hpp"
+
+using namespace std;
+
+//large arrays start at a multiple of this (relative to the buffer), so they can be used in place
+//a cache line, which covers every element type (BVH nodes are aligned to 64 bytes)
+static constexpr size_t SERIALIZER_ALIGNMENT = 64;
+
+class Material;
+
+class ByteWriter
+{
+	vector<char> buffer;
+
+	//materials are shared by many objects, they are written as indices into this list
+	vector<const Material*> materials;
+
+public:
+	template <class T>
+	void write(const T& value)
+	{
+		writeArray(&value, 1);
+	}
+
+	template <class T>
+	void writeArray(const T* values, size_t count)
+	{
+		size_t bytes = sizeof(T) * count;
+		size_t offset = buffer.size();
+		buffer.resize(offset + bytes);
+		if (bytes > 0)
+			memcpy(&buffer[offset], values, bytes);
+	}
+
+	//size first, then the elements (aligned)
+	template <class T>
+	void writeAligned(const T* values, size_t count)
+	{
+		write<long long>(count);
+		buffer.resize((buffer.size() + SERIALIZER_ALIGNMENT - 1) / SERIALIZER_ALIGNMENT * SERIALIZER_ALIGNMENT);
+		writeArray(values, count);
+	}
+
+	template <class T>
+	void writeVector(const vector<T>& values)
+	{
+		writeAligned(values.data(), values.size());
+	}
+
+	template <class T>
+	void writeVector(const SharedArray<T>& values)
+	{
+		writeAligned(values.data(), values.size());
+	}
+
+	void setMaterials(Material** list, int count)
+	{
+		materials.assign(list, list + count);
+	}
+
+	//NULL is written as -1
+	void writeMaterial(const Material* material)
+	{
+		int index = -1;
+		for (int i = 0; i < (int)materials.size(); i++)
+		{
+			if (materials[i] == material)
+				index = i;
+		}
+		if (material != NULL && index < 0)
+			throw runtime_error("object uses an unknown material");
+		write(index);
+	}
+
+	vector<char>& getBuffer()
+	{
+		return buffer;
+	}
+};
+
+class ByteReader
+{
+	const char* data;
+	size_t size;
+	size_t position;
+
+	Material** materials;
+	int numMaterials;
+
+	//if true, large arrays point into "data" instead of being copied
+	bool borrow;
+
+	//threads for hierarchies that are rebuilt instead of read (see "BVHTree::buildTree")
+	int buildThreads;
+
+	//count of an aligned array, skips the padding in front of it
+	template <class T>
+	size_t readAlignedCount()
+	{
+		long long count = read<long long>();
+		position = (position + SERIALIZER_ALIGNMENT - 1) / SERIALIZER_ALIGNMENT * SERIALIZER_ALIGNMENT;
+		if (count < 0 || position > size || (size_t)count > (size - position) / sizeof(T))
+			throw runtime_error("scene buffer is truncated");
+		return count;
+	}
+
+public:
+	//with "borrowArrays", "d" must outlive everything rebuilt from it and be aligned to SERIALIZER_ALIGNMENT
+	ByteReader(const char* d, size_t s, bool borrowArrays = false) :
+		data(d), size(s), position(0), materials(NULL), numMaterials(0), borrow(borrowArrays), buildThreads(0)
+	{
+		if (borrow && (size_t)d % SERIALIZER_ALIGNMENT != 0)
+			throw runtime_error("scene buffer is not aligned");
+	}
+
+	bool isBorrowing() const
+	{
+		return borrow;
+	}
+
+	template <class T>
+	T read()
+	{
+		T value;
+		readArray(&value, 1);
+		return value;
+	}
+
+	template <class T>
+	void readArray(T* values, size_t count)
+	{
+		size_t bytes = sizeof(T) * count;
+		if (bytes > size - position)
+			throw runtime_error("scene buffer is truncated");
+		if (bytes > 0)
+			memcpy((void*)values, data + position, bytes);
+		position += bytes;
+	}
+
+	template <class T>
+	void readVector(vector<T>& values)
+	{
+		size_t count = readAlignedCount<T>();
+		values.resize(count);
+		readArray(values.data(), count);
+	}
+
+	//copy or borrow, see "borrow"
+	template <class T>
+	void readVector(SharedArray<T>& values)
+	{
+		if (!borrow)
+		{
+			vector<T> copy;
+			readVector(copy);
+			values.assign(move(copy));
+			return;
+		}
+
+		size_t count = readAlignedCount<T>();
+		values.borrow(reinterpret_cast<const T*>(data + position), count);
+		position += sizeof(T) * count;
+	}
+
+	void setMaterials(Material** list, int count)
+	{
+		materials = list;
+		numMaterials = count;
+	}
+
+	void setBuildThreads(int numThreads)
+	{
+		buildThreads = numThreads;
+	}
+
+	int getBuildThreads() const
+	{
+		return buildThreads;
+	}
+
+	Material* readMaterial()
+	{
+		int index = read<int>();
+		if (index < -1 || index >= numMaterials)
+			throw runtime_error("illegal material index in scene buffer");
+		return (index < 0) ? NULL : materials[index];
+	}
+};
@@ -0,0 +1,74 @@
+//read-only array that either owns its elements or refers to memory owned by someone else
+//(e.g. a scene buffer in an MPI shared window), so large arrays can be stored once per node
+#pragma once
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+template <class T>
+class SharedArray
+{
+	vector<T> owned;
+	const T* elements;
+	size_t count;
+
+public:
+	SharedArray() : elements(NULL), count(0)
+	{}
+
+	//copying a borrowed array still refers to the same memory
+	SharedArray(const SharedArray& other) : owned(other.owned), elements(other.elements), count(other.count)
+	{
+		if (!owned.empty())
+			elements = owned.data();
+	}
+
+	SharedArray& operator=(const SharedArray& other)
+	{
+		if (this != &other)
+		{
+			owned = other.owned;
+			elements = owned.empty() ? other.elements : owned.data();
+			count = other.count;
+		}
+		return *this;
+	}
+
+	//take over the elements of a vector
+	void assign(vector<T>&& values)
+	{
+		owned = move(values);
+		elements = owned.data();
+		count = owned.size();
+	}
+
+	//refer to "n" elements owned by someone else, they must outlive this array
+	void borrow(const T* values, size_t n)
+	{
+		owned.clear();
+		owned.shrink_to_fit();
+		elements = values;
+		count = n;
+	}
+
+	bool isBorrowed() const
+	{
+		return owned.empty() && count > 0;
+	}
+
+	const T& operator[](size_t i) const
+	{
+		return elements[i];
+	}
+
+	const T* data() const
+	{
+		return elements;
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+};
@@ -8,7 +8,7 @@
 
 class Sphere : public Object3D
 {
-	Vector2f getCoord(const Vector3f& normal, const Vector3f& toViewPoint)
+	Vector2f getCoord(const Vector3f& normal, const Vector3f& toViewPoint) const
 	{
 		//theta = vertical angle, phi = horizontal angle
 		float theta;
@@ -64,9 +64,15 @@ public:
 		radius = r;
 	}
 
+	Sphere(ByteReader& reader) : Object3D(reader.readMaterial())
+	{
+		center = reader.read<Vector3f>();
+		radius = reader.read<float>();
+	}
+
 	~Sphere() override = default;
 
-	bool intersect(const Ray& r, Hit& h, float tmin) override
+	bool intersect(const Ray& r, Hit& h, float tmin) const override
 	{
 		//a*t^2+2b*t+c=0
 		float a = Vector3f::dot(r.getDirection(), r.getDirection());
@@ -87,14 +93,7 @@ public:
 
 			if (t > tmin && t < h.getT())
 			{
-				Vector3f normal = r.pointAtParameter(t) - center;
-				normal.normalize();
-				h.set(t, material, normal);
-
-				if (material->hasValidTexture())
-				{
-					h.setTexCoord(getCoord(normal, -r.getDirection()));
-				}
+				h.setCandidate(t, this);
 				return true;
 			}
 			return false;
@@ -105,40 +104,69 @@ public:
 			float sqrt_delta = sqrt(quarter_delta);
 			float t1 = (-b - sqrt_delta) / a;
 			float t2 = (-b + sqrt_delta) / a;
-			bool changed = false;
 			if (t1 > tmin && t1 < h.getT())
 			{
-				Vector3f normal = r.pointAtParameter(t1) - center;
-				normal.normalize();
-				h.set(t1, material, normal);
-				changed = true;
-
-				if (material->hasValidTexture())
-				{
-					h.setTexCoord(getCoord(normal, -r.getDirection()));
-				}
+				h.setCandidate(t1, this);
+				return true;
 			}
 			if (t2 > tmin && t2 < h.getT())
 			{
-				Vector3f normal = r.pointAtParameter(t2) - center;
-				normal.normalize();
-				h.set(t2, material, normal);
-				changed = true;
-
-				if (material->hasValidTexture())
-				{
-					h.setTexCoord(getCoord(normal, -r.getDirection()));
-				}
+				h.setCandidate(t2, this);
+				return true;
 			}
-			return changed;
+			return false;
 		}
 	}
 
+	//normal and texture coordinate only for the closest hit (getCoord is expensive)
+	void resolve(const Ray& r, Hit& h, int level) const override
+	{
+		Vector3f normal = r.pointAtParameter(h.getT()) - center;
+		normal.normalize();
+		h.set(h.getT(), material, normal);
+
+		if (material->hasValidTexture())
+		{
+			h.setTexCoord(getCoord(normal, -r.getDirection()));
+		}
+	}
+
+	bool occluded(const Ray& r, float tmin, float tmax) const override
+	{
+		float a = Vector3f::dot(r.getDirection(), r.getDirection());
+		float b = Vector3f::dot(r.getOrigin() - center, r.getDirection());
+		float c = Vector3f::dot(r.getOrigin() - center, r.getOrigin() - center) - radius * radius;
+
+		float quarter_delta = b * b - a * c;
+		if (quarter_delta < 0)
+			return false;
+
+		float sqrt_delta = sqrt(quarter_delta);
+		float t1 = (-b - sqrt_delta) / a;
+		float t2 = (-b + sqrt_delta) / a;
+		return (t1 > tmin && t1 < tmax) || (t2 > tmin && t2 < tmax);
+	}
+
 	object_type getType() override
 	{
 		return SPHERE;
 	}
 
+	bool getBoundingBox(Box& box) const override
+	{
+		Vector3f extent(radius, radius, radius);
+		box = Box(center - extent, center + extent);
+		return true;
+	}
+
+	void serialize(ByteWriter& writer) const override
+	{
+		writer.write<int>(SPHERE);
+		writer.writeMaterial(material);
+		writer.write(center);
+		writer.write(radius);
+	}
+
 protected:
 	Vector3f center;
 	float radius;
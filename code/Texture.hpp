@@ -1,33 +1,62 @@
 #pragma once
 #include "BitmapImage.hpp"
 #include "Vector3f.h"
+#include "Serializer.hpp"
 
 ///@brief helper class that stores a texture and faciliates lookup
 ///assume 4byte RGBA image data
 class Texture 
 {
 public:
-	Texture() :bimg(0), width(0), height(0)
+	Texture() :width(0), height(0)
 	{}
-	~Texture()
+
+	bool valid()
+	{
+		return pixels.size() > 0;
+	}
+
+	void load(const char* filename)
 	{
-		if (bimg)
+		//load texture image, keep only its RGB pixels
+		bitmap_image bimg(filename);
+		height = bimg.height();
+		width = bimg.width();
+
+		vector<unsigned char> rgb(width * height * 3);
+		for (int y = 0; y < height; y++)
 		{
-			delete bimg;
+			for (int x = 0; x < width; x++)
+			{
+				unsigned char* p = &rgb[(y * width + x) * 3];
+				bimg.get_pixel(x, y, p[0], p[1], p[2]);
+			}
 		}
+		pixels.assign(move(rgb));
 	}
 
-	bool valid()
+	//size, then RGB pixels row by row (size 0 = no texture)
+	void serialize(ByteWriter& writer) const
 	{
-		return bimg != 0;
+		bool loaded = pixels.size() > 0;
+		writer.write(loaded ? width : 0);
+		writer.write(loaded ? height : 0);
+		if (loaded)
+			writer.writeVector(pixels);
 	}
 
-	void load(const char* filename)
+	void deserialize(ByteReader& reader)
 	{
-		//load texture image
-		bimg = new bitmap_image(filename);
-		height = bimg->height();
-		width = bimg->width();
+		int w = reader.read<int>();
+		int h = reader.read<int>();
+		if (w <= 0 || h <= 0)
+			return;
+
+		reader.readVector(pixels);
+		if (pixels.size() != (size_t)w * h * 3)
+			throw runtime_error("texture size does not match in scene buffer");
+		width = w;
+		height = h;
 	}
 
 	void operator()(int x, int y, unsigned char* color)
@@ -37,7 +66,10 @@ public:
 		x = (x > width - 1) ? (width - 1) : x;
 		y = (y < 0) ? 0 : y;
 		y = (y > height - 1) ? (height - 1) : y;
-		bimg->get_pixel(x, y, color[0], color[1], color[2]);
+		const unsigned char* p = &pixels[(y * width + x) * 3];
+		color[0] = p[0];
+		color[1] = p[1];
+		color[2] = p[2];
 	}
 
 	///@param x assumed to be between 0 and 1
@@ -67,6 +99,7 @@ public:
 	}
 
 
-	bitmap_image* bimg;
+	//RGB, row by row, may be borrowed from a shared scene buffer
+	SharedArray<unsigned char> pixels;
 	int width, height;
 };
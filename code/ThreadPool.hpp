@@ -0,0 +1,187 @@
+//persistent work-stealing thread pool used for shared-memory rendering
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+using namespace std;
+
+class ThreadPool
+{
+	//a task receives the index of the worker that runs it,
+	//so callers can keep per-thread data (e.g. one MCTracer per worker)
+	typedef function<void(int)> Task;
+
+	//every worker owns a deque: it pops from the front of its own deque
+	//and steals from the back of others when it runs out of work
+	struct WorkQueue
+	{
+		deque<Task> tasks;
+		mutex lock;
+	};
+
+	vector<thread> workers;
+	vector<WorkQueue*> queues;
+
+	//used for sleeping when there is nothing to do
+	mutex sleepLock;
+	condition_variable wakeUp;
+	condition_variable allDone;
+
+	atomic<int> pending;		//submitted but not finished
+	atomic<int> queued;			//waiting inside some queue
+	atomic<int> nextQueue;		//round-robin target for external submissions
+	bool stopping;
+
+	//which pool and worker the calling thread belongs to
+	static ThreadPool*& currentPool()
+	{
+		static thread_local ThreadPool* pool = NULL;
+		return pool;
+	}
+	static int& currentIndex()
+	{
+		static thread_local int index = -1;
+		return index;
+	}
+
+	//index of the calling thread inside this pool, -1 for other threads
+	int currentWorker()
+	{
+		return (currentPool() == this) ? currentIndex() : -1;
+	}
+
+	bool popTask(int index, Task& task)
+	{
+		//own queue first
+		{
+			WorkQueue* own = queues[index];
+			lock_guard<mutex> guard(own->lock);
+			if (!own->tasks.empty())
+			{
+				task = move(own->tasks.front());
+				own->tasks.pop_front();
+				queued--;
+				return true;
+			}
+		}
+
+		//steal from the other end of someone else's queue
+		int numQueues = queues.size();
+		for (int i = 1; i < numQueues; i++)
+		{
+			WorkQueue* victim = queues[(index + i) % numQueues];
+			lock_guard<mutex> guard(victim->lock);
+			if (!victim->tasks.empty())
+			{
+				task = move(victim->tasks.back());
+				victim->tasks.pop_back();
+				queued--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void workerLoop(int index)
+	{
+		currentPool() = this;
+		currentIndex() = index;
+
+		while (true)
+		{
+			Task task;
+			if (popTask(index, task))
+			{
+				task(index);
+
+				if (--pending == 0)
+				{
+					lock_guard<mutex> guard(sleepLock);
+					allDone.notify_all();
+				}
+				continue;
+			}
+
+			unique_lock<mutex> guard(sleepLock);
+			wakeUp.wait(guard, [this]() { return stopping || queued > 0; });
+			if (stopping && queued == 0)
+				return;
+		}
+	}
+
+public:
+	//numThreads <= 0 means "use all hardware threads"
+	ThreadPool(int numThreads = 0) : pending(0), queued(0), nextQueue(0), stopping(false)
+	{
+		if (numThreads <= 0)
+			numThreads = thread::hardware_concurrency();
+		if (numThreads <= 0)
+			numThreads = 1;
+
+		for (int i = 0; i < numThreads; i++)
+			queues.push_back(new WorkQueue());
+
+		for (int i = 0; i < numThreads; i++)
+			workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+	}
+
+	~ThreadPool()
+	{
+		wait();
+		{
+			lock_guard<mutex> guard(sleepLock);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+
+		for (auto& worker : workers)
+			worker.join();
+		for (auto queue : queues)
+			delete queue;
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const
+	{
+		return workers.size();
+	}
+
+	//tasks submitted from a worker go to the front of its own queue (LIFO keeps its data hot),
+	//others are spread round-robin and run in submission order
+	void submit(Task task)
+	{
+		int index = currentWorker();
+		bool local = index >= 0;
+		if (!local)
+			index = (nextQueue++) % (int)queues.size();
+
+		pending++;
+		{
+			lock_guard<mutex> guard(queues[index]->lock);
+			if (local)
+				queues[index]->tasks.push_front(move(task));
+			else
+				queues[index]->tasks.push_back(move(task));
+			queued++;
+		}
+		{
+			//pairs with the predicate check in "workerLoop", so no wake-up is lost
+			lock_guard<mutex> guard(sleepLock);
+		}
+		wakeUp.notify_one();
+	}
+
+	//block until every submitted task has finished, must not be called from a worker
+	void wait()
+	{
+		unique_lock<mutex> guard(sleepLock);
+		allDone.wait(guard, [this]() { return pending == 0; });
+	}
+};
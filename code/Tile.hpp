@@ -0,0 +1,116 @@
+//rectangular piece of the image, the unit of work for parallel rendering
+#pragma once
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+struct Tile
+{
+	//pixels [x0, x1) x [y0, y1)
+	int x0, y0;
+	int x1, y1;
+
+	int getWidth() const
+	{
+		return x1 - x0;
+	}
+
+	int getHeight() const
+	{
+		return y1 - y0;
+	}
+
+	int getNumPixels() const
+	{
+		return getWidth() * getHeight();
+	}
+};
+
+//order in which tiles are handed out
+enum TileOrder
+{
+	TILE_ROWS = 0,		//row by row
+	TILE_MORTON = 1,	//Z-order curve
+	TILE_HILBERT = 2	//Hilbert curve, neighbours along the curve always share an edge
+};
+
+//position of cell (x, y) along the Z-order curve: interleave the bits of x and y
+static unsigned int mortonIndex(unsigned int x, unsigned int y)
+{
+	unsigned int index = 0;
+	for (int bit = 0; bit < 16; bit++)
+	{
+		index |= ((x >> bit) & 1u) << (2 * bit);
+		index |= ((y >> bit) & 1u) << (2 * bit + 1);
+	}
+	return index;
+}
+
+//position of cell (x, y) along the Hilbert curve covering an n x n grid (n is a power of 2)
+static unsigned int hilbertIndex(unsigned int n, unsigned int x, unsigned int y)
+{
+	unsigned int index = 0;
+	for (unsigned int s = n / 2; s > 0; s /= 2)
+	{
+		unsigned int rx = (x & s) ? 1 : 0;
+		unsigned int ry = (y & s) ? 1 : 0;
+		index += s * s * ((3 * rx) ^ ry);
+
+		//rotate the quadrant, so the curve stays connected
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			swap(x, y);
+		}
+	}
+	return index;
+}
+
+//cut a width x height image into tiles of (at most) tileSize x tileSize pixels
+//with a space-filling curve, tiles rendered one after another are close to each other,
+//so neighbouring rays share the same part of the BVH and textures in cache
+static vector<Tile> generateTiles(int width, int height, int tileSize, int order = TILE_ROWS)
+{
+	int numX = (width + tileSize - 1) / tileSize;
+	int numY = (height + tileSize - 1) / tileSize;
+
+	//the curves are defined on a square grid of size 2^k, cells outside the image are skipped
+	unsigned int n = 1;
+	while ((int)n < max(numX, numY))
+		n *= 2;
+
+	vector<pair<unsigned int, Tile>> keyed;
+	for (int ty = 0; ty < numY; ty++)
+	{
+		for (int tx = 0; tx < numX; tx++)
+		{
+			Tile tile;
+			tile.x0 = tx * tileSize;
+			tile.y0 = ty * tileSize;
+			tile.x1 = min(tile.x0 + tileSize, width);
+			tile.y1 = min(tile.y0 + tileSize, height);
+
+			unsigned int key = ty * numX + tx;
+			if (order == TILE_MORTON)
+				key = mortonIndex(tx, ty);
+			else if (order == TILE_HILBERT)
+				key = hilbertIndex(n, tx, ty);
+			keyed.push_back(make_pair(key, tile));
+		}
+	}
+
+	sort(keyed.begin(), keyed.end(), [](const pair<unsigned int, Tile>& a, const pair<unsigned int, Tile>& b)
+		{
+			return a.first < b.first;
+		});
+
+	vector<Tile> tiles;
+	for (auto& item : keyed)
+		tiles.push_back(item.second);
+	return tiles;
+}
@@ -0,0 +1,74 @@
+//mutable state of one tracing thread, the scene and MCTracer themselves are read-only
+#pragma once
+#include "Random.hpp"
+
+//most media a path can be inside at once (e.g. water in a glass in the air)
+static constexpr int MEDIUMSTACKSIZE = 8;
+
+//refraction indexes of the media a path is inside, innermost last
+//fixed size and copied along with the path, so following a path never allocates
+struct MediumStack
+{
+    float index[MEDIUMSTACKSIZE];
+    int size;
+
+    MediumStack(float outside = 1.0f)
+    {
+        index[0] = outside;
+        size = 1;
+    }
+
+    //medium the path is in now
+    float top() const
+    {
+        return index[size - 1];
+    }
+
+    //medium behind the surface when leaving the current one, the outermost one is never left
+    float outer() const
+    {
+        return (size > 1) ? index[size - 2] : index[0];
+    }
+
+    //when full, the innermost medium is replaced
+    void enter(float refr)
+    {
+        if (size < MEDIUMSTACKSIZE)
+            size++;
+        index[size - 1] = refr;
+    }
+
+    void leave()
+    {
+        if (size > 1)
+            size--;
+    }
+};
+
+class TraceContext
+{
+    friend class MCTracer;
+
+    //refraction index of the medium camera rays start in
+    float outsideIndex;
+
+public:
+    TraceContext(unsigned int seed, float refr = 1.0) : random(seed)
+    {
+        outsideIndex = refr;
+
+        maxDepth = 0;
+        numRays = 0;
+        numSamples = 0;
+    }
+
+    TraceContext(const TraceContext&) = delete;
+    TraceContext& operator=(const TraceContext&) = delete;
+
+    Random random;
+
+    //statistics
+    int maxDepth;           //most bounces of a path seen so far
+    long long numRays;      //every ray cast into the scene, including shadow rays
+    long long numSamples;   //number of camera samples
+};
@@ -19,12 +19,47 @@ static Vector3f transformDirection(const Matrix4f& mat, const Vector3f& dir)
 
 class Transform : public Object3D
 {
+        //the ray in the object's space, with a unit direction ("len" = length before normalizing)
+        Ray toLocal(const Ray& r, float& len) const
+        {
+            Vector3f trSource = transformPoint(transform, r.getOrigin());
+            Vector3f trDirection = transformDirection(transform, r.getDirection());
+            len = trDirection.length();
+            trDirection.normalize();
+            return Ray(trSource, trDirection, r.getTime());
+        }
+
+        //a hit path holds the object and every wrapper around it
+        void checkDepth() const
+        {
+            if (getWrapperDepth() >= HITPATHSIZE)
+                throw runtime_error("transforms and velocities are nested too deeply");
+        }
+
     public:
         Transform() = delete;
 
         Transform(const Matrix4f& m, Object3D* obj) : o(obj)
         {
             transform = m.inverse();
+            checkDepth();
+        }
+
+        //the inverse matrix is stored, so it is not inverted again
+        Transform(ByteReader& reader)
+        {
+            transform = reader.read<Matrix4f>();
+            o = readObject(reader);
+            try
+            {
+                checkDepth();
+            }
+            catch (...)
+            {
+                //no destructor for a half-built object
+                delete o;
+                throw;
+            }
         }
 
         ~Transform()
@@ -32,28 +67,47 @@ class Transform : public Object3D
             delete o;
         }
 
-        virtual bool intersect(const Ray& r, Hit& h, float tmin)
+        //the candidate found inside is kept as it is, "resolve" transforms its normal
+        virtual bool intersect(const Ray& r, Hit& h, float tmin) const
         {
-            Vector3f trSource = transformPoint(transform, r.getOrigin());
-            Vector3f trDirection = transformDirection(transform, r.getDirection());
-            float len = trDirection.length();
-            trDirection.normalize();
+            float len;
+            Ray tr = toLocal(r, len);
 
-            Ray tr(trSource, trDirection);
-            Hit h0;
-            bool inter = o->intersect(tr, h0, tmin);
+            //the closest hit so far limits the search inside (in local units)
+            Hit h0(h.getT() * len, NULL, Vector3f());
+            if (!o->intersect(tr, h0, tmin))
+                return false;
 
-            if (inter)
-            {
-                float t0 = h0.getT() / len;
-                if (t0 < h.getT())
-                {
-                    h.set(t0, h0.getMaterial(), transformDirection(transform.transposed(), h0.getNormal()).normalized());
-                    if (h0.hasTex)
-                        h.setTexCoord(h0.texCoord);
-                }
-            }
-            return inter;
+            float t0 = h0.getT() / len;
+            if (t0 >= h.getT())
+                return false;
+            h = h0;
+            h.t = t0;
+            h.addWrapper(this);
+            return true;
+        }
+
+        void resolve(const Ray& r, Hit& h, int level) const override
+        {
+            float len;
+            Ray tr = toLocal(r, len);
+            float t = h.getT();
+            h.t = t * len;
+            h.path[level - 1]->resolve(tr, h, level - 1);
+            h.set(t, h.getMaterial(), transformDirection(transform.transposed(), h.getNormal()).normalized());
+        }
+
+        //"intersect" divides the local t by "len", so the local limit is tmax * len
+        bool occluded(const Ray& r, float tmin, float tmax) const override
+        {
+            float len;
+            Ray tr = toLocal(r, len);
+            return o->occluded(tr, tmin, tmax * len);
+        }
+
+        int getWrapperDepth() const override
+        {
+            return 1 + o->getWrapperDepth();
         }
 
         object_type getType() override
@@ -61,6 +115,35 @@ class Transform : public Object3D
             return TRANSFORM;
         }
 
+        //box around the 8 transformed corners of the object's box
+        bool getBoundingBox(Box& box) const override
+        {
+            Box local;
+            if (!o->getBoundingBox(local))
+                return false;
+
+            Matrix4f forward = transform.inverse();
+            for (int i = 0; i < 8; i++)
+            {
+                Vector3f corner((i & 1) ? local.upper[0] : local.lower[0],
+                    (i & 2) ? local.upper[1] : local.lower[1],
+                    (i & 4) ? local.upper[2] : local.lower[2]);
+                Vector3f point = transformPoint(forward, corner);
+                if (i == 0)
+                    box = Box(point, point);
+                else
+                    box.expand(point);
+            }
+            return true;
+        }
+
+        void serialize(ByteWriter& writer) const override
+        {
+            writer.write<int>(TRANSFORM);
+            writer.write(transform);
+            o->serialize(writer);
+        }
+
     protected:
         Object3D* o; //un-transformed object
         Matrix4f transform;
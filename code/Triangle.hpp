@@ -5,7 +5,6 @@
 
 class Triangle : public Object3D
 {
-	friend class Mesh;
 public:
 	Triangle() = delete;
 
@@ -18,70 +17,119 @@ public:
 		vertices[0] = a;
 		vertices[1] = b;
 		vertices[2] = c;
-		//normal vector already computed in Mesh::intersectTrig
 		hasTex = false;
 	}
 
-	virtual bool intersect(const Ray& ray, Hit& hit, float tmin)
+	Triangle(ByteReader& reader) : Object3D(reader.readMaterial())
 	{
-		Vector3f a = vertices[0];
-		Vector3f b = vertices[1];
-		Vector3f c = vertices[2];
+		reader.readArray(vertices, 3);
+		reader.readArray(normals, 3);
+		reader.readArray(texCoords, 3);
+		hasTex = reader.read<bool>();
+	}
 
-		Vector3f D1 = a - b;
-		Vector3f D2 = a - c;
-		Vector3f D3 = ray.getDirection();
+	//Möller-Trumbore: solves origin + t * direction = a + beta * edge1 + gamma * edge2 with a few cross products,
+	//no matrix is built, meshes run the same steps on 4 triangles at once ("Mesh::intersectLeaf")
+	//edges count as inside, rays parallel to the triangle (or NaN) never hit
+	static bool intersectEdges(const float* origin, const float* direction, const float* a, const float* edge1, const float* edge2,
+		float tmin, float tmax, float& t, float& beta, float& gamma)
+	{
+		float p[3] = {
+			direction[1] * edge2[2] - direction[2] * edge2[1],
+			direction[2] * edge2[0] - direction[0] * edge2[2],
+			direction[0] * edge2[1] - direction[1] * edge2[0] };
+		float determinant = edge1[0] * p[0] + edge1[1] * p[1] + edge1[2] * p[2];
+		if (determinant == 0)
+			return false;
+		float inverse = 1.0f / determinant;
 
-		Matrix3f M(D1, D2, D3, true);
+		float s[3] = { origin[0] - a[0], origin[1] - a[1], origin[2] - a[2] };
+		beta = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inverse;
+		if (!(beta >= 0 && beta <= 1))
+			return false;
 
-		bool issingular;
-		Matrix3f MI = M.inverse(&issingular);
-		if (issingular)
-		{
+		float q[3] = {
+			s[1] * edge1[2] - s[2] * edge1[1],
+			s[2] * edge1[0] - s[0] * edge1[2],
+			s[0] * edge1[1] - s[1] * edge1[0] };
+		gamma = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * inverse;
+		if (!(gamma >= 0 && beta + gamma <= 1))
 			return false;
-		}
-		else
+
+		t = (edge2[0] * q[0] + edge2[1] * q[1] + edge2[2] * q[2]) * inverse;
+		return t > tmin && t < tmax;
+	}
+
+	virtual bool intersect(const Ray& ray, Hit& hit, float tmin) const
+	{
+		const Vector3f& a = vertices[0];
+		Vector3f edge1 = vertices[1] - a;
+		Vector3f edge2 = vertices[2] - a;
+
+		float t, beta, gamma;
+		if (!intersectEdges(ray.getOrigin(), ray.getDirection(), a, edge1, edge2, tmin, hit.getT(), t, beta, gamma))
+			return false;
+
+		hit.setCandidate(t, this, 0, beta, gamma);
+		return true;
+	}
+
+	void resolve(const Ray& ray, Hit& hit, int level) const override
+	{
+		float beta = hit.u;
+		float gamma = hit.v;
+		float alpha = 1 - beta - gamma;
+
+		//interpolate normal vector
+		Vector3f normal = alpha * normals[0] +
+			beta * normals[1] +
+			gamma * normals[2];
+		normal.normalize();
+
+		hit.set(hit.getT(), material, normal);
+		//interpolate texture coordinate
+		if (hasTex)
 		{
-			//solve for barycentric coordinates
-			Vector3f B = a - ray.getOrigin();
-			Vector3f x = MI * B;
-
-			float beta = x[0];
-			float gamma = x[1];
-			float alpha = 1.0 - beta - gamma;
-			float t = x[2];
-
-			if ((alpha >= 0) && (beta >= 0) && (gamma >= 0) && (t > tmin) && (t < hit.getT()))
-			{
-				//interpolate normal vector
-				Vector3f normal = alpha * normals[0] +
-					beta * normals[1] +
-					gamma * normals[2];
-				normal.normalize();
-
-				hit.set(t, material, normal);
-				//interpolate texture coordinate
-				if (hasTex)
-				{
-					Vector2f texCoord = alpha * texCoords[0] +
-						beta * texCoords[1] +
-						gamma * texCoords[2];
-					hit.setTexCoord(texCoord);
-				}
-				return true;
-			}
-			else
-			{
-				return false;
-			}
+			Vector2f texCoord = alpha * texCoords[0] +
+				beta * texCoords[1] +
+				gamma * texCoords[2];
+			hit.setTexCoord(texCoord);
 		}
 	}
 
+	bool occluded(const Ray& ray, float tmin, float tmax) const override
+	{
+		const Vector3f& a = vertices[0];
+		Vector3f edge1 = vertices[1] - a;
+		Vector3f edge2 = vertices[2] - a;
+
+		float t, beta, gamma;
+		return intersectEdges(ray.getOrigin(), ray.getDirection(), a, edge1, edge2, tmin, tmax, t, beta, gamma);
+	}
+
 	object_type getType() override
 	{
 		return TRIANGLE;
 	}
 
+	bool getBoundingBox(Box& box) const override
+	{
+		box = Box(vertices[0], vertices[0]);
+		box.expand(vertices[1]);
+		box.expand(vertices[2]);
+		return true;
+	}
+
+	void serialize(ByteWriter& writer) const override
+	{
+		writer.write<int>(TRIANGLE);
+		writer.writeMaterial(material);
+		writer.writeArray(vertices, 3);
+		writer.writeArray(normals, 3);
+		writer.writeArray(texCoords, 3);
+		writer.write(hasTex);
+	}
+
 protected:
 	Vector3f vertices[3];
 	Vector3f normals[3];
@@ -2,7 +2,6 @@
 #pragma once
 
 #include <iostream>
-#include <random>
 
 #include "vecmath.h"
 #include "Object3d.hpp"
@@ -14,12 +13,44 @@ class Velocity : public Object3D
 	Object3D* object;
 	Vector3f velocity;
 
+	//the ray carries a random time between -1 and 1 (sampled once per camera sample)
+	//move this object is equal to moving the incoming ray at opposite direction
+	Ray toLocal(const Ray& r) const
+	{
+		Vector3f bias = velocity * r.getTime();
+		Vector3f origin = r.getOrigin() - bias;
+		return Ray(origin, r.getDirection(), r.getTime());
+	}
+
+	void checkDepth() const
+	{
+		if (getWrapperDepth() >= HITPATHSIZE)
+			throw runtime_error("transforms and velocities are nested too deeply");
+	}
+
 public:
 	Velocity() = delete;
 
 	Velocity(const Vector3f& v, Object3D* o) : object(o)
 	{
 		velocity = v;
+		checkDepth();
+	}
+
+	Velocity(ByteReader& reader)
+	{
+		velocity = reader.read<Vector3f>();
+		object = readObject(reader);
+		try
+		{
+			checkDepth();
+		}
+		catch (...)
+		{
+			//no destructor for a half-built object
+			delete object;
+			throw;
+		}
 	}
 
 	~Velocity()
@@ -27,26 +58,51 @@ public:
 		delete object;
 	}
 
-    virtual bool intersect(const Ray& r, Hit& h, float tmin)
+    virtual bool intersect(const Ray& r, Hit& h, float tmin) const
     {
-		//radomly sample a time between -1 and 1
-		static random_device rd;
-		static mt19937 gen(rd());
-		uniform_real_distribution<> dis(-1, 1);
-
-		float time = dis(gen);
-		Vector3f bias = velocity * time;
+		if (!object->intersect(toLocal(r), h, tmin))
+			return false;
+		h.addWrapper(this);
+		return true;
+    }
 
-		//move this object is equal to moving the incoming ray at opposite direction
-		Vector3f origin = r.getOrigin() - bias;
-		Ray newRay(origin, r.getDirection());
+	//the candidate was found on the moved ray, so it is resolved there
+	void resolve(const Ray& r, Hit& h, int level) const override
+	{
+		h.path[level - 1]->resolve(toLocal(r), h, level - 1);
+	}
 
-		return object->intersect(newRay, h, tmin);
+    bool occluded(const Ray& r, float tmin, float tmax) const override
+    {
+		return object->occluded(toLocal(r), tmin, tmax);
     }
 
+	int getWrapperDepth() const override
+	{
+		return 1 + object->getWrapperDepth();
+	}
+
     object_type getType() override
     {
         return VELOCITY;
     }
 
+    //the object moves between -velocity and +velocity (the ray time is between -1 and 1)
+    bool getBoundingBox(Box& box) const override
+    {
+        Box still;
+        if (!object->getBoundingBox(still))
+            return false;
+        box = Box(still.lower - velocity, still.upper - velocity);
+        box.expand(Box(still.lower + velocity, still.upper + velocity));
+        return true;
+    }
+
+    void serialize(ByteWriter& writer) const override
+    {
+        writer.write<int>(VELOCITY);
+        writer.write(velocity);
+        object->serialize(writer);
+    }
+
 };
\ No newline at end of file
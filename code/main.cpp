@@ -1,6 +1,7 @@
 //there are several ways to run this code:
 //1. hit "start" button
-//2. run "mpiexec -n 16 .\Graphics" inside "Graphics\x64\release" directory
+//2. run ".\Graphics --threads 8" to choose the number of rendering threads
+//3. run "mpiexec -n 16 .\Graphics" inside "Graphics\x64\release" directory
 // (you need to set "USEMPI" as true in "Configuration.hpp")
 #include "Render.hpp"
 
@@ -9,7 +10,7 @@ int main(int argc, char* argv[])
 	if (USEMPI)
 		render_MPI(argc, argv);
 	else
-		render();
+		render(parseOptions(argc, argv));
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,52 @@
+//regression test: rays with a NaN direction must not reach the unused slots of a 4-wide node
+//build from the repository root on a case-insensitive file system like the main project (includes such as "vecmath.h"), e.g.
+//	g++ -std=c++17 -Icode test/BVHTest.cpp code/BVH.cpp code/Material.cpp code/Vector2f.cpp code/Vector3f.cpp code/Vector4f.cpp
+//		code/Matrix2f.cpp code/Matrix3f.cpp code/Matrix4f.cpp code/Quat4f.cpp -lpthread -o BVHTest
+#include <cmath>
+#include <iostream>
+
+#include "Group.hpp"
+#include "Sphere.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool condition, const char* message)
+{
+	if (!condition)
+	{
+		cout << "FAILED: " << message << endl;
+		failures++;
+	}
+}
+
+int main()
+{
+	//two spheres fit in one leaf, so the root has a single child and three unused slots
+	Group group;
+	group.addObject(new Sphere(Vector3f(0, 0, -5), 1, NULL));
+	group.addObject(new Sphere(Vector3f(3, 0, -5), 1, NULL));
+	group.buildHierarchy(1);
+
+	Vector3f origin(0, 0, 0);
+	Ray ray(origin, Vector3f(0, 0, -1));
+	Hit hit;
+	check(group.intersect(ray, hit, 0.001f), "a finite ray hits the first sphere");
+	check(fabs(hit.getT() - 4) < 1e-4f, "the hit is on the near side of the first sphere");
+	check(group.occluded(ray, 0.001f, 10), "a finite ray is occluded");
+
+	float nan = NAN;
+	Vector3f directions[] = { Vector3f(nan, nan, nan), Vector3f(0, 0, nan), Vector3f(0, INFINITY, -1) };
+	for (const Vector3f& direction : directions)
+	{
+		Ray bad(origin, direction);
+		Hit missed;
+		check(!group.intersect(bad, missed, 0.001f), "a non-finite ray hits nothing");
+		check(!group.occluded(bad, 0.001f, INFINITY), "a non-finite ray is not occluded");
+	}
+
+	if (failures == 0)
+		cout << "all BVH tests passed" << endl;
+	return failures == 0 ? 0 : 1;
+}